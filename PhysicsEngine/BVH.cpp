@@ -1,56 +1,183 @@
 #include "BVH.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
 
 
+AABBDynamicTree::AABBDynamicTree(Shape* box) : aabbBox(box)
+{
+}
+
 AABBDynamicTree::~AABBDynamicTree()
 {
 }
 
-void AABBDynamicTree::Insert(RigidBody* data)
+int AABBDynamicTree::Insert(RigidBody* data)
 {
-	
 	int leaf = AllocateNode();
 
-	nodes[leaf]->m_box.m_shape = aabbBox;
-	nodes[leaf]->m_box.m_lower = data->m_collider->m_aabb.m_lower - extent;
-	nodes[leaf]->m_box.m_upper = data->m_collider->m_aabb.m_upper + extent;
-	nodes[leaf]->m_left = -1;
-	nodes[leaf]->m_right = -1;
-	nodes[leaf]->m_clientData = data;
-	nodes[leaf]->m_hieght = 0;
+	nodes[leaf].m_margin = extent;
+	nodes[leaf].m_box = FattenAABB(data->m_collider->m_aabb, extent, glm::vec3(0.f));
+	nodes[leaf].m_clientData = data;
+	nodes[leaf].m_filter = data->m_filter;
+	nodes[leaf].m_hieght = 0;
+
+	InsertLeaf(leaf);
+	BufferMove(leaf);
+	++proxyCount;
+	return leaf;
+}
+
+void AABBDynamicTree::InsertBatch(const std::vector<RigidBody*>& bodies, std::vector<int>& proxyIds)
+{
+	proxyIds.clear();
+	if (bodies.empty())
+		return;
+
+	proxyIds.reserve(bodies.size());
+	for (RigidBody* data : bodies)
+	{
+		int leaf = AllocateNode();
+
+		nodes[leaf].m_margin = extent;
+		nodes[leaf].m_box = FattenAABB(data->m_collider->m_aabb, extent, glm::vec3(0.f));
+		nodes[leaf].m_clientData = data;
+		nodes[leaf].m_filter = data->m_filter;
+		nodes[leaf].m_hieght = 0;
+
+		BufferMove(leaf);
+		proxyIds.push_back(leaf);
+	}
+
+	bool largeBatch = (int)bodies.size() >= proxyCount;
+	proxyCount += (int)bodies.size();
+
+	//A batch bigger than the tree would dominate it, rebuild everything at once
+	if (largeBatch)
+	{
+		Rebuild();
+		return;
+	}
+
+	//Otherwise build a subtree of the batch and insert its root like a leaf
+	int count = (int)proxyIds.size();
+	InsertLeaf(useLinearBuild ? BuildLinear(proxyIds.data(), count) : BuildTree(proxyIds.data(), count));
+}
+
+void AABBDynamicTree::Remove(int proxyId)
+{
+	RemoveLeaf(proxyId);
+	FreeNode(proxyId);
+	--proxyCount;
+}
+
+void AABBDynamicTree::MoveProxy(int proxyId)
+{
+	RemoveLeaf(proxyId);
+
+	const AABB& aabb = nodes[proxyId].m_clientData->m_collider->m_aabb;
+	nodes[proxyId].m_box = FattenAABB(aabb, nodes[proxyId].m_margin, glm::vec3(0.f));
+
+	InsertLeaf(proxyId);
+	BufferMove(proxyId);
+}
+
+void AABBDynamicTree::RefilterProxy(int proxyId)
+{
+	//a buffered proxy loses its pairs and queries the trees again
+	nodes[proxyId].m_filter = nodes[proxyId].m_clientData->m_filter;
+	BufferMove(proxyId);
+}
+
+bool AABBDynamicTree::UpdateProxy(int proxyId, const AABB& aabb, const glm::vec3& displacement)
+{
+	Node& leaf = nodes[proxyId];
+	glm::vec3 d = displacementMultiplier * displacement;
+
+	if (leaf.m_box.Contains(aabb))
+	{
+		//Still inside, but a box stretched for a fast body is a waste once it slows down
+		AABB huge = FattenAABB(aabb, 4.0f * leaf.m_margin, glm::vec3(0.f));
+		huge.m_lower -= 4.0f * glm::abs(d);
+		huge.m_upper += 4.0f * glm::abs(d);
+		if (huge.Contains(leaf.m_box))
+			return false;
+
+		leaf.m_margin = std::max(0.5f * leaf.m_margin, minExtent);
+	}
+	else
+		leaf.m_margin = std::min(2.0f * leaf.m_margin, maxExtent);
+
+	RemoveLeaf(proxyId);
+	nodes[proxyId].m_box = FattenAABB(aabb, nodes[proxyId].m_margin, d);
+	InsertLeaf(proxyId);
+	BufferMove(proxyId);
+	return true;
+}
+
+AABB AABBDynamicTree::FattenAABB(const AABB& aabb, float margin, const glm::vec3& displacement) const
+{
+	//fatten aabb, then stretch it along the displacement
+	AABB fat;
+	fat.m_lower = aabb.m_lower - margin;
+	fat.m_upper = aabb.m_upper + margin;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (displacement[i] < 0.f)
+			fat.m_lower[i] += displacement[i];
+		else
+			fat.m_upper[i] += displacement[i];
+	}
+	return fat;
+}
+
+void AABBDynamicTree::BufferMove(int proxyId)
+{
+	if (nodes[proxyId].m_moved)
+		return;
+
+	nodes[proxyId].m_moved = true;
+	moveBuffer.push_back(proxyId);
+}
+
+void AABBDynamicTree::InsertLeaf(int leaf)
+{
+	++insertsSinceCheck;
+	wideDirty = true;
 
 	//If the tree is empty
 	if (rootIndex == -1)
 	{
 		rootIndex = leaf;
-		nodes[rootIndex]->m_parent = -1;
+		nodes[rootIndex].m_parent = -1;
 		return;
 	}
 
 	//1 : Find best sibling
-	AABB leafAABB = nodes[leaf]->m_box;
+	AABB leafAABB = nodes[leaf].m_box;
 	int sibling = rootIndex;
-	while (!nodes[sibling]->IsLeaf())
+	while (!nodes[sibling].IsLeaf())
 	{
-		int left = nodes[sibling]->m_left;
-		int right = nodes[sibling]->m_right;
+		int left = nodes[sibling].m_left;
+		int right = nodes[sibling].m_right;
 		
-		AABB combined = Union(nodes[sibling]->m_box, leafAABB);
+		AABB combined = Union(nodes[sibling].m_box, leafAABB);
 		float combinedArea = Area(combined);
 		float cost = 2.0f * combinedArea;
-		float inheritCost = 2.0f * (combinedArea - Area(nodes[sibling]->m_box));
+		float inheritCost = 2.0f * (combinedArea - Area(nodes[sibling].m_box));
 
 		float leftCost = inheritCost;
-		if (nodes[left]->IsLeaf()) //isLeaf
-			leftCost += Area(Union(nodes[left]->m_box, leafAABB));
+		if (nodes[left].IsLeaf()) //isLeaf
+			leftCost += Area(Union(nodes[left].m_box, leafAABB));
 		else
-			leftCost += Area(Union(nodes[left]->m_box, leafAABB)) - Area(nodes[left]->m_box);
+			leftCost += Area(Union(nodes[left].m_box, leafAABB)) - Area(nodes[left].m_box);
 
 		float rightCost = inheritCost;
-		if (nodes[right]->IsLeaf())//isLeaf
-			rightCost += Area(Union(nodes[right]->m_box, leafAABB));
+		if (nodes[right].IsLeaf())//isLeaf
+			rightCost += Area(Union(nodes[right].m_box, leafAABB));
 		else
-			rightCost += Area(Union(nodes[right]->m_box, leafAABB)) - Area(nodes[right]->m_box);
+			rightCost += Area(Union(nodes[right].m_box, leafAABB)) - Area(nodes[right].m_box);
 
 		if (cost < leftCost && cost < rightCost) //minimum cost
 			break;
@@ -62,131 +189,827 @@ void AABBDynamicTree::Insert(RigidBody* data)
 	}
 
 	//2 : Create a new parent
-	int oldParent = nodes[sibling]->m_parent;
+	int oldParent = nodes[sibling].m_parent;
 
 	int newParent = AllocateNode();
 
-	nodes[newParent]->m_parent = oldParent;
-	nodes[newParent]->m_clientData = nullptr;
-	nodes[newParent]->m_box = Union(leafAABB, nodes[sibling]->m_box);
-	nodes[newParent]->m_hieght = nodes[sibling]->m_hieght + 1;
+	nodes[newParent].m_parent = oldParent;
+	nodes[newParent].m_clientData = nullptr;
+	nodes[newParent].m_box = Union(leafAABB, nodes[sibling].m_box);
+	nodes[newParent].m_hieght = nodes[sibling].m_hieght + 1;
 
 	if (oldParent != -1)
 	{
-		if (nodes[oldParent]->m_left == sibling)
-			nodes[oldParent]->m_left = newParent;
+		if (nodes[oldParent].m_left == sibling)
+			nodes[oldParent].m_left = newParent;
 		else
-			nodes[oldParent]->m_right = newParent;
+			nodes[oldParent].m_right = newParent;
 
-		nodes[newParent]->m_left = sibling;
-		nodes[newParent]->m_right = leaf;
-		nodes[sibling]->m_parent = newParent;
-		nodes[leaf]->m_parent = newParent;
+		nodes[newParent].m_left = sibling;
+		nodes[newParent].m_right = leaf;
+		nodes[sibling].m_parent = newParent;
+		nodes[leaf].m_parent = newParent;
 	}
 	else
 	{
-		nodes[newParent]->m_left = sibling;
-		nodes[newParent]->m_right = leaf;
-		nodes[sibling]->m_parent = newParent;
-		nodes[leaf]->m_parent = newParent;
+		nodes[newParent].m_left = sibling;
+		nodes[newParent].m_right = leaf;
+		nodes[sibling].m_parent = newParent;
+		nodes[leaf].m_parent = newParent;
 		rootIndex = newParent;
 	}
 
 	//3 : Walk back up the tree refitting AABBs
-	int index = nodes[leaf]->m_parent;
+	int index = nodes[leaf].m_parent;
 	while (index != -1)
 	{
 		index = Balance(index);
-		int left = nodes[index]->m_left;
-		int right = nodes[index]->m_right;
+		int left = nodes[index].m_left;
+		int right = nodes[index].m_right;
 
-		nodes[index]->m_hieght = std::max(nodes[left]->m_hieght, nodes[right]->m_hieght) + 1;
-		nodes[index]->m_box = Union(nodes[left]->m_box, nodes[right]->m_box);
+		nodes[index].m_hieght = std::max(nodes[left].m_hieght, nodes[right].m_hieght) + 1;
+		nodes[index].m_box = Union(nodes[left].m_box, nodes[right].m_box);
 
-		index = nodes[index]->m_parent;
+		index = nodes[index].m_parent;
 	}
 
 }
 
-void AABBDynamicTree::Remove(int index)
+void AABBDynamicTree::RemoveLeaf(int index)
 {
+	wideDirty = true;
+
 	if (index == rootIndex)
 	{
 		rootIndex = -1;
-		FreeNode(index);
 		return;
 	}
 
-	int parent = nodes[index]->m_parent;
-	int grandParent = nodes[parent]->m_parent;
+	int parent = nodes[index].m_parent;
+	int grandParent = nodes[parent].m_parent;
 	int sibling;
-	if (nodes[parent]->m_left == index)
-		sibling = nodes[parent]->m_right;
+	if (nodes[parent].m_left == index)
+		sibling = nodes[parent].m_right;
 	else
-		sibling = nodes[parent]->m_left;
+		sibling = nodes[parent].m_left;
 
 	if (grandParent == -1)
 	{
 		rootIndex = sibling;
-		nodes[sibling]->m_parent = -1;
+		nodes[sibling].m_parent = -1;
 		FreeNode(parent);
 	}
 	else
 	{
-		if (nodes[grandParent]->m_left == parent)
-			nodes[grandParent]->m_left = sibling;
+		if (nodes[grandParent].m_left == parent)
+			nodes[grandParent].m_left = sibling;
 		else
-			nodes[grandParent]->m_right = sibling;
+			nodes[grandParent].m_right = sibling;
 
-		nodes[sibling]->m_parent = grandParent;
+		nodes[sibling].m_parent = grandParent;
 		FreeNode(parent);
 
 		int i = grandParent;
 		while (i != -1)
 		{
 			i = Balance(i);
-			int left = nodes[i]->m_left;
-			int right = nodes[i]->m_right;
+			int left = nodes[i].m_left;
+			int right = nodes[i].m_right;
+
+			nodes[i].m_box = Union(nodes[left].m_box, nodes[right].m_box);
+			nodes[i].m_hieght = 1 + std::max(nodes[left].m_hieght, nodes[right].m_hieght);
+
+			i = nodes[i].m_parent;
+		}
+	}
+
+	nodes[index].m_parent = NULL_NODE;
+}
+
+void AABBDynamicTree::UpdatePairs(const std::function<void(int, int)>& callback)
+{
+	FindPairs(nullptr, callback, nullptr);
+}
+
+void AABBDynamicTree::UpdatePairs(AABBDynamicTree& staticTree, const std::function<void(int, int)>& callback,
+	const std::function<void(int, int)>& staticCallback)
+{
+	FindPairs(&staticTree, callback, staticCallback);
+}
+
+void AABBDynamicTree::FindPairs(AABBDynamicTree* staticTree, const std::function<void(int, int)>& callback,
+	const std::function<void(int, int)>& staticCallback)
+{
+	PrepareMoveBuffer();
+	if (staticTree)
+		staticTree->PrepareMoveBuffer();
+
+	//Drop pairs with removed or moved proxies, the rest cannot have changed
+	pairBuffer.erase(std::remove_if(pairBuffer.begin(), pairBuffer.end(), [&](const std::pair<int, int>& p)
+		{
+			return !IsValidProxy(p.first) || !IsValidProxy(p.second) || nodes[p.first].m_moved || nodes[p.second].m_moved;
+		}), pairBuffer.end());
+
+	staticPairBuffer.erase(std::remove_if(staticPairBuffer.begin(), staticPairBuffer.end(), [&](const std::pair<int, int>& p)
+		{
+			return !staticTree || !IsValidProxy(p.first) || !staticTree->IsValidProxy(p.second)
+				|| nodes[p.first].m_moved || staticTree->nodes[p.second].m_moved;
+		}), staticPairBuffer.end());
+
+	//The wide copies are refreshed here, the searches below only read them
+	if (useWide)
+		RefreshWide();
+	if (staticTree && staticTree->useWide)
+		staticTree->RefreshWide();
+
+	const int minParallelMoves = 256;
+	int workers = pairThreadCount > 0 ? pairThreadCount : std::max((int)std::thread::hardware_concurrency(), 1);
+
+	if (workers > 1 && (int)moveBuffer.size() >= minParallelMoves)
+		FindPairsParallel(staticTree, workers);
+	else
+	{
+		for (int proxyId : moveBuffer)
+			FindProxyPairs(proxyId, staticTree, pairBuffer, staticPairBuffer);
+	}
+
+	//Static proxies moved by hand, skipping the moved proxies found above
+	if (staticTree)
+	{
+		for (int staticId : staticTree->moveBuffer)
+		{
+			Query(staticTree->nodes[staticId].m_box, [&](int other)
+				{
+					if (!nodes[other].m_moved && ShouldPair(nodes[other], staticTree->nodes[staticId]))
+						staticPairBuffer.emplace_back(other, staticId);
+					return true;
+				});
+		}
+
+		staticTree->ClearMoveBuffer();
+	}
+
+	ClearMoveBuffer();
+
+	for (const auto& p : pairBuffer)
+		callback(p.first, p.second);
+
+	if (staticTree)
+	{
+		for (const auto& p : staticPairBuffer)
+			staticCallback(p.first, p.second);
+	}
+}
+
+void AABBDynamicTree::FindProxyPairs(int proxyId, const AABBDynamicTree* staticTree,
+	std::vector<std::pair<int, int>>& pairs, std::vector<std::pair<int, int>>& staticPairs) const
+{
+	QueryTree(nodes[proxyId].m_box, [&](int other)
+		{
+			//both moved : only the lower id adds the pair, so no task
+			//reports a pair another one found
+			if (other == proxyId || (nodes[other].m_moved && other < proxyId))
+				return true;
+
+			if (!ShouldPair(nodes[proxyId], nodes[other]))
+				return true;
+
+			pairs.emplace_back(std::min(proxyId, other), std::max(proxyId, other));
+			return true;
+		});
+
+	if (staticTree)
+	{
+		staticTree->QueryTree(nodes[proxyId].m_box, [&](int other)
+			{
+				if (!ShouldPair(nodes[proxyId], staticTree->nodes[other]))
+					return true;
+
+				staticPairs.emplace_back(proxyId, other);
+				return true;
+			});
+	}
+}
+
+void AABBDynamicTree::FindPairsParallel(const AABBDynamicTree* staticTree, int workers)
+{
+	//Small tasks pulled from a counter keep the threads busy when some
+	//proxies sit in dense piles, the task order keeps the result the same
+	//as the serial loop whatever thread ran each task
+	const int taskSize = 64;
+	int moveCount = (int)moveBuffer.size();
+	int taskCount = (moveCount + taskSize - 1) / taskSize;
+	workers = std::min(workers, taskCount);
+
+	pairTasks.resize(taskCount);
+	pairThreads.resize(std::max((int)pairThreads.size(), workers));
+	for (int t = 0; t < workers; ++t)
+	{
+		pairThreads[t].m_pairs.clear();
+		pairThreads[t].m_staticPairs.clear();
+	}
+
+	std::atomic<int> nextTask(0);
+	auto work = [&](int thread)
+	{
+		PairThread& out = pairThreads[thread];
+		for (int task = nextTask++; task < taskCount; task = nextTask++)
+		{
+			PairTask& range = pairTasks[task];
+			range.m_thread = thread;
+			range.m_begin = (int)out.m_pairs.size();
+			range.m_staticBegin = (int)out.m_staticPairs.size();
+
+			int end = std::min((task + 1) * taskSize, moveCount);
+			for (int i = task * taskSize; i < end; ++i)
+				FindProxyPairs(moveBuffer[i], staticTree, out.m_pairs, out.m_staticPairs);
+
+			range.m_end = (int)out.m_pairs.size();
+			range.m_staticEnd = (int)out.m_staticPairs.size();
+		}
+	};
+
+	workerPool->Run(workers, work);
+
+	for (const PairTask& range : pairTasks)
+	{
+		const PairThread& out = pairThreads[range.m_thread];
+		pairBuffer.insert(pairBuffer.end(), out.m_pairs.begin() + range.m_begin, out.m_pairs.begin() + range.m_end);
+		staticPairBuffer.insert(staticPairBuffer.end(), out.m_staticPairs.begin() + range.m_staticBegin,
+			out.m_staticPairs.begin() + range.m_staticEnd);
+	}
+}
+
+void AABBDynamicTree::PrepareMoveBuffer()
+{
+	//A proxy can be buffered twice if it was removed and its id reused
+	std::sort(moveBuffer.begin(), moveBuffer.end());
+	moveBuffer.erase(std::unique(moveBuffer.begin(), moveBuffer.end()), moveBuffer.end());
+	moveBuffer.erase(std::remove_if(moveBuffer.begin(), moveBuffer.end(), [this](int i)
+		{
+			return !IsValidProxy(i) || !nodes[i].m_moved;
+		}), moveBuffer.end());
+}
+
+void AABBDynamicTree::ClearMoveBuffer()
+{
+	for (int proxyId : moveBuffer)
+		nodes[proxyId].m_moved = false;
+	moveBuffer.clear();
+}
+
+void AABBDynamicTree::Query(const AABB& aabb, const std::function<bool(int)>& callback)
+{
+	if (useWide)
+		RefreshWide();
+
+	QueryTree(aabb, callback);
+}
+
+void AABBDynamicTree::QueryTree(const AABB& aabb, const std::function<bool(int)>& callback) const
+{
+	if (rootIndex == NULL_NODE)
+		return;
+
+	if (useWide)
+	{
+		wideTree.Query(aabb, callback);
+		return;
+	}
+
+	GrowableStack<int> stack;
+	stack.Push(rootIndex);
+
+	while (!stack.IsEmpty())
+	{
+		int curr = stack.Pop();
+
+		const Node& node = nodes[curr];
+		if (!node.m_box.Overlaps(aabb))
+			continue;
+
+		if (node.IsLeaf())
+		{
+			if (!callback(curr))
+				return;
+		}
+		else
+		{
+			stack.Push(node.m_left);
+			stack.Push(node.m_right);
+		}
+	}
+}
+
+void AABBDynamicTree::QuerySphere(const glm::vec3& center, float radius, const std::function<bool(int)>& callback)
+{
+	if (rootIndex == NULL_NODE)
+		return;
+
+	GrowableStack<int> stack;
+	stack.Push(rootIndex);
+
+	while (!stack.IsEmpty())
+	{
+		int curr = stack.Pop();
+
+		const Node& node = nodes[curr];
+		if (!node.m_box.OverlapsSphere(center, radius))
+			continue;
+
+		if (node.IsLeaf())
+		{
+			if (!callback(curr))
+				return;
+		}
+		else
+		{
+			stack.Push(node.m_left);
+			stack.Push(node.m_right);
+		}
+	}
+}
+
+void AABBDynamicTree::QueryFrustum(const Frustum& frustum, const std::function<bool(int)>& callback)
+{
+	if (rootIndex == NULL_NODE)
+		return;
+
+	//the plane tests keep boxes near the corners, the corner box rejects them
+	AABB bounds = frustum.Bounds();
+	const int allPlanes = (1 << 6) - 1;
+	GrowableStack<std::pair<int, int>> stack; // (node, planes still straddled)
+	stack.Push(std::make_pair(rootIndex, allPlanes));
+
+	while (!stack.IsEmpty())
+	{
+		std::pair<int, int> entry = stack.Pop();
+		int curr = entry.first;
+		int planeMask = entry.second;
+
+		//a node inside every plane needs no more tests, only its leaves
+		const Node& node = nodes[curr];
+		if (!node.m_box.Overlaps(bounds))
+			continue;
+		if (planeMask != 0 && frustum.Classify(node.m_box, planeMask) == FrustumTest::OUTSIDE)
+			continue;
+
+		if (node.IsLeaf())
+		{
+			if (!callback(curr))
+				return;
+		}
+		else
+		{
+			stack.Push(std::make_pair(node.m_left, planeMask));
+			stack.Push(std::make_pair(node.m_right, planeMask));
+		}
+	}
+}
+
+void AABBDynamicTree::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<float(int, float)>& callback)
+{
+	if (rootIndex == NULL_NODE)
+		return;
+
+	if (useWide)
+	{
+		RefreshWide();
+		wideTree.RayCast(origin, direction, maxT, callback);
+		return;
+	}
+
+	glm::vec3 invDir = 1.0f / direction;
+
+	GrowableStack<int> stack;
+	stack.Push(rootIndex);
+
+	while (!stack.IsEmpty())
+	{
+		int curr = stack.Pop();
+
+		float t;
+		const Node& node = nodes[curr];
+		if (!node.m_box.RayIntersect(origin, invDir, maxT, t))
+			continue;
+
+		if (node.IsLeaf())
+		{
+			maxT = callback(curr, t);
+			if (maxT <= 0.f)
+				return;
+		}
+		else
+		{
+			stack.Push(node.m_left);
+			stack.Push(node.m_right);
+		}
+	}
+}
+
+void AABBDynamicTree::RayCastPacket(RayPacket& packet, const std::function<float(int, int, float)>& callback)
+{
+	if (rootIndex == NULL_NODE)
+		return;
+
+	float tEnter[RayPacket::SIZE];
+
+	GrowableStack<int> stack;
+	stack.Push(rootIndex);
+
+	while (!stack.IsEmpty())
+	{
+		int curr = stack.Pop();
+
+		const Node& node = nodes[curr];
+		int mask = packet.Intersect(node.m_box, tEnter) & packet.ActiveMask();
+		if (mask == 0)
+			continue;
+
+		if (!node.IsLeaf())
+		{
+			stack.Push(node.m_left);
+			stack.Push(node.m_right);
+			continue;
+		}
+
+		for (int ray = 0; ray < packet.m_count; ++ray)
+		{
+			if (mask & (1 << ray))
+				packet.m_maxT[ray] = callback(ray, curr, tEnter[ray]);
+		}
+
+		if (packet.ActiveMask() == 0)
+			return;
+	}
+}
+
+void AABBDynamicTree::RefreshWide()
+{
+	if (!wideDirty)
+		return;
+
+	wideTree.Build(nodes.data(), rootIndex);
+	wideDirty = false;
+}
+
+void AABBDynamicTree::Rebuild()
+{
+	std::vector<int> leaves;
+	leaves.reserve(proxyCount);
+
+	//Keep the leaves, recycle every internal node
+	for (int i = 0; i < (int)nodes.size(); ++i)
+	{
+		if (nodes[i].m_hieght == -1)
+			continue;
+
+		if (nodes[i].IsLeaf())
+			leaves.push_back(i);
+		else
+			FreeNode(i);
+	}
+
+	rootIndex = NULL_NODE;
+	if (!leaves.empty())
+	{
+		if (useLinearBuild)
+			rootIndex = BuildLinear(leaves.data(), (int)leaves.size());
+		else
+			rootIndex = BuildTree(leaves.data(), (int)leaves.size());
+	}
+
+	builtCost = ComputeSAHCost();
+	insertsSinceCheck = 0;
+	wideDirty = true;
+}
+
+bool AABBDynamicTree::RebuildIfDegraded()
+{
+	//Measuring is O(n), so wait until a good part of the tree was reinserted
+	if (insertsSinceCheck < std::max(proxyCount / 8, 16))
+		return false;
+
+	insertsSinceCheck = 0;
+	if (ComputeSAHCost() <= rebuildThreshold * builtCost)
+		return false;
+
+	Rebuild();
+	return true;
+}
+
+float AABBDynamicTree::ComputeSAHCost() const
+{
+	if (rootIndex == NULL_NODE)
+		return 0.f;
+
+	float rootArea = Area(nodes[rootIndex].m_box);
+	if (rootArea <= 0.f)
+		return 0.f;
+
+	float totalArea = 0.f;
+	for (const Node& node : nodes)
+	{
+		if (node.m_hieght > 0)
+			totalArea += Area(node.m_box);
+	}
+
+	return totalArea / rootArea;
+}
+
+int AABBDynamicTree::Optimize(int maxNodes)
+{
+	int count = (int)nodes.size();
+	if (rootIndex == NULL_NODE || count == 0)
+		return 0;
+
+	//Walk the node array round robin so every node is revisited after
+	//count / maxNodes steps, whatever moved in between
+	int rotations = 0;
+	for (int visited = std::min(maxNodes, count); visited > 0; --visited)
+	{
+		optimizeCursor = (optimizeCursor + 1) % count;
+
+		//free nodes, leaves and parents of two leaves have nothing to rotate
+		if (nodes[optimizeCursor].m_hieght >= 2 && Rotate(optimizeCursor))
+			++rotations;
+	}
+
+	if (rotations > 0)
+		wideDirty = true;
 
-			nodes[i]->m_box = Union(nodes[left]->m_box, nodes[right]->m_box);
-			nodes[i]->m_hieght = 1 + std::max(nodes[left]->m_hieght, nodes[right]->m_hieght);
+	return rotations;
+}
+
+bool AABBDynamicTree::Rotate(int index)
+{
+	//         A
+	//      /     \
+	//     B       C
+	//   /   \    /  \
+	//  D     E  F    G
+	//
+	//Swapping a child with a grandchild on the other side (B <-> F, B <-> G,
+	//C <-> D, C <-> E) or two grandchildren (D <-> F, D <-> G) keeps the box
+	//of A and only changes B or C. Apply the swap that shrinks them the most
+
+	const Node& A = nodes[index];
+	int b = A.m_left;
+	int c = A.m_right;
+	const Node& B = nodes[b];
+	const Node& C = nodes[c];
+
+	float areaB = Area(B.m_box);
+	float areaC = Area(C.m_box);
+
+	float bestGain = 0.f;
+	int swapA = NULL_NODE;
+	int swapB = NULL_NODE;
 
-			i = nodes[i]->m_parent;
+	auto consider = [&](float gain, int x, int y)
+	{
+		if (gain > bestGain)
+		{
+			bestGain = gain;
+			swapA = x;
+			swapB = y;
+		}
+	};
+
+	if (!C.IsLeaf())
+	{
+		int f = C.m_left;
+		int g = C.m_right;
+		consider(areaC - Area(Union(B.m_box, nodes[g].m_box)), b, f);
+		consider(areaC - Area(Union(nodes[f].m_box, B.m_box)), b, g);
+	}
+
+	if (!B.IsLeaf())
+	{
+		int d = B.m_left;
+		int e = B.m_right;
+		consider(areaB - Area(Union(C.m_box, nodes[e].m_box)), c, d);
+		consider(areaB - Area(Union(nodes[d].m_box, C.m_box)), c, e);
+
+		if (!C.IsLeaf())
+		{
+			int f = C.m_left;
+			int g = C.m_right;
+			consider(areaB + areaC - Area(Union(nodes[f].m_box, nodes[e].m_box)) - Area(Union(nodes[d].m_box, nodes[g].m_box)), d, f);
+			consider(areaB + areaC - Area(Union(nodes[g].m_box, nodes[e].m_box)) - Area(Union(nodes[f].m_box, nodes[d].m_box)), d, g);
 		}
 	}
 
-	FreeNode(index);
+	if (swapA == NULL_NODE)
+		return false;
+
+	int parentA = nodes[swapA].m_parent;
+	int parentB = nodes[swapB].m_parent;
+	SwapNodes(swapA, swapB);
+
+	//refit the changed children of A first, then heights up to the root.
+	//Boxes above A are unchanged, the leaves under it are the same
+	if (parentA != index)
+		Refit(parentA);
+	if (parentB != index)
+		Refit(parentB);
+
+	for (int i = index; i != NULL_NODE; i = nodes[i].m_parent)
+		Refit(i);
+
+	return true;
+}
+
+void AABBDynamicTree::SwapNodes(int a, int b)
+{
+	int parentA = nodes[a].m_parent;
+	int parentB = nodes[b].m_parent;
+
+	if (nodes[parentA].m_left == a)
+		nodes[parentA].m_left = b;
+	else
+		nodes[parentA].m_right = b;
+
+	if (nodes[parentB].m_left == b)
+		nodes[parentB].m_left = a;
+	else
+		nodes[parentB].m_right = a;
+
+	nodes[a].m_parent = parentB;
+	nodes[b].m_parent = parentA;
+}
+
+void AABBDynamicTree::Refit(int index)
+{
+	Node& node = nodes[index];
+	node.m_box = Union(nodes[node.m_left].m_box, nodes[node.m_right].m_box);
+	node.m_hieght = std::max(nodes[node.m_left].m_hieght, nodes[node.m_right].m_hieght) + 1;
+}
+
+int AABBDynamicTree::BuildTree(const int* leaves, int count)
+{
+	//Copy the boxes next to each other, the build partitions this array
+	//instead of jumping around the node pool
+	buildLeaves.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		BuildLeaf& entry = buildLeaves[i];
+		entry.m_box = nodes[leaves[i]].m_box;
+		entry.m_centroid = (entry.m_box.m_lower + entry.m_box.m_upper) * 0.5f;
+		entry.m_index = leaves[i];
+	}
+
+	int root = BuildRange(buildLeaves.data(), count);
+	nodes[root].m_parent = NULL_NODE;
+	return root;
 }
 
-void AABBDynamicTree::Update()
+int AABBDynamicTree::BuildLinear(const int* leaves, int count)
 {
-	std::queue<int> q;
-	std::vector<std::pair<int, RigidBody*>> datas;
+	//Allocate every internal node first, the builder fills them in parallel
+	linearNodes.resize(std::max(count - 1, 0));
+	for (int& index : linearNodes)
+		index = AllocateNode();
+
+	linearBuilder.pool = workerPool.get();
+	return linearBuilder.Build(nodes.data(), (int)nodes.size(), leaves, linearNodes.data(), count);
+}
 
-	if (rootIndex != -1)
-		q.push(rootIndex);
+int AABBDynamicTree::BuildRange(BuildLeaf* leaves, int count)
+{
+	if (count == 1)
+		return leaves[0].m_index;
 
-	while (!q.empty())
+	AABB bounds = leaves[0].m_box;
+	glm::vec3 centroidMin = leaves[0].m_centroid;
+	glm::vec3 centroidMax = centroidMin;
+	for (int i = 1; i < count; ++i)
 	{
-		int currIndex = q.front();
-		q.pop();
+		bounds = Union(bounds, leaves[i].m_box);
+		centroidMin = glm::min(centroidMin, leaves[i].m_centroid);
+		centroidMax = glm::max(centroidMax, leaves[i].m_centroid);
+	}
 
-		if (nodes[currIndex]->m_left != -1)
-			q.push(nodes[currIndex]->m_left);
-		if (nodes[currIndex]->m_right != -1)
-			q.push(nodes[currIndex]->m_right);
+	//Binning costs more than it saves on a handful of leaves : split them
+	//at the median of the longest centroid axis
+	glm::vec3 spread = centroidMax - centroidMin;
+	const int smallRange = 4;
+	if (count <= smallRange)
+	{
+		int axis = spread.x > spread.y ? (spread.x > spread.z ? 0 : 2) : (spread.y > spread.z ? 1 : 2);
+		int mid = count / 2;
+		std::nth_element(leaves, leaves + mid, leaves + count, [axis](const BuildLeaf& a, const BuildLeaf& b)
+			{
+				return a.m_centroid[axis] < b.m_centroid[axis];
+			});
+		return LinkRange(leaves, count, mid, bounds);
+	}
+
+	//Binned SAH : try binCount - 1 planes per axis, keep the cheapest.
+	//The bins of the three axes are filled in one pass over the leaves
+	const int binCount = 16;
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = FLT_MAX;
 
+	AABB binBoxes[3][binCount];
+	int binCounts[3][binCount] = {};
+	glm::vec3 scales;
+	for (int axis = 0; axis < 3; ++axis)
+		scales[axis] = spread[axis] > 0.f ? binCount / spread[axis] : 0.f;
 
-		if (nodes[currIndex]->IsLeaf() && !nodes[currIndex]->m_box.Contains(nodes[currIndex]->m_clientData->m_collider->m_aabb))
-			datas.emplace_back(std::make_pair(currIndex, nodes[currIndex]->m_clientData));
+	for (int i = 0; i < count; ++i)
+	{
+		const AABB& box = leaves[i].m_box;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			int bin = std::min((int)((leaves[i].m_centroid[axis] - centroidMin[axis]) * scales[axis]), binCount - 1);
+			AABB& binBox = binBoxes[axis][bin];
+			binBox = binCounts[axis][bin] == 0 ? box : Union(binBox, box);
+			++binCounts[axis][bin];
+		}
 	}
 
-	for (int i = 0; i < datas.size(); ++i)
-		Remove(datas[i].first);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (spread[axis] <= 0.f)
+			continue;
+
+		const AABB* binBox = binBoxes[axis];
+		const int* binLeaves = binCounts[axis];
+
+		//sweep from the right to get the cost of every right side
+		float rightArea[binCount];
+		int rightLeaves[binCount];
+		AABB acc;
+		int accCount = 0;
+		for (int bin = binCount - 1; bin > 0; --bin)
+		{
+			if (binLeaves[bin] > 0)
+			{
+				acc = accCount == 0 ? binBox[bin] : Union(acc, binBox[bin]);
+				accCount += binLeaves[bin];
+			}
+			rightArea[bin] = accCount > 0 ? Area(acc) : 0.f;
+			rightLeaves[bin] = accCount;
+		}
+
+		accCount = 0;
+		for (int bin = 0; bin < binCount - 1; ++bin)
+		{
+			if (binLeaves[bin] > 0)
+			{
+				acc = accCount == 0 ? binBox[bin] : Union(acc, binBox[bin]);
+				accCount += binLeaves[bin];
+			}
+
+			if (accCount == 0 || rightLeaves[bin + 1] == 0)
+				continue;
+
+			float cost = accCount * Area(acc) + rightLeaves[bin + 1] * rightArea[bin + 1];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = bin;
+			}
+		}
+	}
+
+	int mid = count / 2;
+	if (bestAxis != -1)
+	{
+		float scale = scales[bestAxis];
+		float minAxis = centroidMin[bestAxis];
+		BuildLeaf* it = std::partition(leaves, leaves + count, [&](const BuildLeaf& leaf)
+			{
+				return std::min((int)((leaf.m_centroid[bestAxis] - minAxis) * scale), binCount - 1) <= bestSplit;
+			});
+		mid = (int)(it - leaves);
+	}
 
-	for (int i = 0; i < datas.size(); ++i)
-		Insert(datas[i].second);
+	//all centroids in one spot : split by count
+	if (mid == 0 || mid == count)
+		mid = count / 2;
 
+	return LinkRange(leaves, count, mid, bounds);
+}
+
+int AABBDynamicTree::LinkRange(BuildLeaf* leaves, int count, int mid, const AABB& bounds)
+{
+	int left = BuildRange(leaves, mid);
+	int right = BuildRange(leaves + mid, count - mid);
+
+	int parent = AllocateNode();
+	nodes[parent].m_left = left;
+	nodes[parent].m_right = right;
+	nodes[parent].m_box = bounds;
+	nodes[parent].m_hieght = std::max(nodes[left].m_hieght, nodes[right].m_hieght) + 1;
+	nodes[left].m_parent = parent;
+	nodes[right].m_parent = parent;
+
+	return parent;
 }
 
 int AABBDynamicTree::Balance(int index)
@@ -197,64 +1020,64 @@ int AABBDynamicTree::Balance(int index)
 	//   /   \    /  \
 	//  D     E  F    G
 
-	std::shared_ptr<Node> A = nodes[index];
-	if (A->IsLeaf() || A->m_hieght < 2)
+	Node& A = nodes[index];
+	if (A.IsLeaf() || A.m_hieght < 2)
 		return index;
 
-	std::shared_ptr<Node> B = nodes[A->m_left];
-	std::shared_ptr<Node> C = nodes[A->m_right];
+	Node& B = nodes[A.m_left];
+	Node& C = nodes[A.m_right];
 
-	int balance = C->m_hieght - B->m_hieght;
+	int balance = C.m_hieght - B.m_hieght;
 	int a = index;
-	int b = A->m_left;
-	int c = A->m_right;
+	int b = A.m_left;
+	int c = A.m_right;
 
 	// If right subtree height is bigger, rotate C up
 	if (balance > 1)
 	{
-		std::shared_ptr<Node> F = nodes[C->m_left];
-		std::shared_ptr<Node> G = nodes[C->m_right];
-		int f = C->m_left;
-		int g = C->m_right;
+		Node& F = nodes[C.m_left];
+		Node& G = nodes[C.m_right];
+		int f = C.m_left;
+		int g = C.m_right;
 
 		// A <-> C
-		C->m_left = a;
-		C->m_parent = A->m_parent;
-		A->m_parent = c;
+		C.m_left = a;
+		C.m_parent = A.m_parent;
+		A.m_parent = c;
 
 		//correct the parent's children
-		if (C->m_parent == -1)
+		if (C.m_parent == -1)
 			rootIndex = c;
 		else
 		{
-			if (nodes[C->m_parent]->m_left == a)
-				nodes[C->m_parent]->m_left = c;
+			if (nodes[C.m_parent].m_left == a)
+				nodes[C.m_parent].m_left = c;
 			else
-				nodes[C->m_parent]->m_right = c;
+				nodes[C.m_parent].m_right = c;
 		}
 
 		//rotate
-		if (F->m_hieght > G->m_hieght)
+		if (F.m_hieght > G.m_hieght)
 		{
-			C->m_right = f;
-			A->m_right = g;
-			G->m_parent = a;
-			A->m_box = Union(B->m_box, G->m_box);
-			C->m_box = Union(A->m_box, F->m_box);
-
-			A->m_hieght = std::max(B->m_hieght, G->m_hieght) + 1;
-			C->m_hieght = std::max(A->m_hieght, F->m_hieght) + 1;
+			C.m_right = f;
+			A.m_right = g;
+			G.m_parent = a;
+			A.m_box = Union(B.m_box, G.m_box);
+			C.m_box = Union(A.m_box, F.m_box);
+
+			A.m_hieght = std::max(B.m_hieght, G.m_hieght) + 1;
+			C.m_hieght = std::max(A.m_hieght, F.m_hieght) + 1;
 		}
 		else
 		{
-			C->m_right = g;
-			A->m_right = f;
-			F->m_parent = a;
-			A->m_box = Union(B->m_box, F->m_box);
-			C->m_box = Union(A->m_box, G->m_box);
-
-			A->m_hieght = std::max(B->m_hieght, F->m_hieght) + 1;
-			C->m_hieght = std::max(A->m_hieght, G->m_hieght) + 1;
+			C.m_right = g;
+			A.m_right = f;
+			F.m_parent = a;
+			A.m_box = Union(B.m_box, F.m_box);
+			C.m_box = Union(A.m_box, G.m_box);
+
+			A.m_hieght = std::max(B.m_hieght, F.m_hieght) + 1;
+			C.m_hieght = std::max(A.m_hieght, G.m_hieght) + 1;
 		}
 		
 		return c;
@@ -263,48 +1086,48 @@ int AABBDynamicTree::Balance(int index)
 	// If left subtree height is bigger, rotate B up
 	if (balance < -1)
 	{
-		int d = B->m_left;
-		int e = B->m_right;
-		std::shared_ptr<Node> D = nodes[d];
-		std::shared_ptr<Node> E = nodes[e];
+		int d = B.m_left;
+		int e = B.m_right;
+		Node& D = nodes[d];
+		Node& E = nodes[e];
 
 		// A <-> B
-		B->m_left = a;
-		B->m_parent = A->m_parent;
-		A->m_parent = b;
+		B.m_left = a;
+		B.m_parent = A.m_parent;
+		A.m_parent = b;
 
-		if (B->m_parent == -1)
+		if (B.m_parent == -1)
 			rootIndex = b;
 		else
 		{
-			if (nodes[B->m_parent]->m_left == a)
-				nodes[B->m_parent]->m_left = b;
+			if (nodes[B.m_parent].m_left == a)
+				nodes[B.m_parent].m_left = b;
 			else
-				nodes[B->m_parent]->m_right = b;
+				nodes[B.m_parent].m_right = b;
 		}
 
 		//rotate
-		if (D->m_hieght > E->m_hieght)
+		if (D.m_hieght > E.m_hieght)
 		{
-			B->m_right = d;
-			A->m_left = e;
-			E->m_parent = a;
-			A->m_box = Union(C->m_box, E->m_box);
-			B->m_box = Union(A->m_box, D->m_box);
-
-			A->m_hieght = std::max(C->m_hieght, E->m_hieght) + 1;
-			B->m_hieght = std::max(A->m_hieght, D->m_hieght) + 1;
+			B.m_right = d;
+			A.m_left = e;
+			E.m_parent = a;
+			A.m_box = Union(C.m_box, E.m_box);
+			B.m_box = Union(A.m_box, D.m_box);
+
+			A.m_hieght = std::max(C.m_hieght, E.m_hieght) + 1;
+			B.m_hieght = std::max(A.m_hieght, D.m_hieght) + 1;
 		}
 		else
 		{
-			B->m_right = e;
-			A->m_left = d;
-			D->m_parent = a;
-			A->m_box = Union(C->m_box, D->m_box);
-			B->m_box = Union(A->m_box, E->m_box);
-
-			A->m_hieght = std::max(C->m_hieght, D->m_hieght) + 1;
-			B->m_hieght = std::max(A->m_hieght, E->m_hieght) + 1;
+			B.m_right = e;
+			A.m_left = d;
+			D.m_parent = a;
+			A.m_box = Union(C.m_box, D.m_box);
+			B.m_box = Union(A.m_box, E.m_box);
+
+			A.m_hieght = std::max(C.m_hieght, D.m_hieght) + 1;
+			B.m_hieght = std::max(A.m_hieght, E.m_hieght) + 1;
 		}
 
 		return b;
@@ -316,73 +1139,56 @@ int AABBDynamicTree::Balance(int index)
 
 void AABBDynamicTree::Draw(int programId)
 {
-	std::queue<int> q;
-	if (rootIndex != -1)
-		q.push(rootIndex);
-
-	while (!q.empty())
+	for (int i = 0; i < (int)nodes.size(); ++i)
 	{
-		int curr = q.front();
-		q.pop();
-
-		if (nodes[curr]->m_left != -1)
-			q.push(nodes[curr]->m_left);
-		if (nodes[curr]->m_right != -1)
-			q.push(nodes[curr]->m_right);
+		if (nodes[i].m_hieght == -1)
+			continue;
 
-		nodes[curr]->m_box.Draw(programId);
+		nodes[i].m_box.Draw(programId, aabbBox, debugColliding[i]);
 	}
 }
 
-int AABBDynamicTree::FindIndex(RigidBody* data)
+int AABBDynamicTree::AllocateNode()
 {
-	std::queue<int> q;
-	if (rootIndex != -1)
-		q.push(rootIndex);
-
-	while (!q.empty())
+	//Grow the pool and thread the new nodes onto the free list
+	if (freeList == NULL_NODE)
 	{
-		int curr = q.front();
-		q.pop();
-
-		if (nodes[curr]->m_clientData == data)
-			return curr;
-
-		if (nodes[curr]->m_left != -1)
-			q.push(nodes[curr]->m_left);
-		if (nodes[curr]->m_right != -1)
-			q.push(nodes[curr]->m_right);
+		int oldCapacity = (int)nodes.size();
+		int newCapacity = oldCapacity == 0 ? 16 : oldCapacity * 2;
+		nodes.resize(newCapacity);
+		debugColliding.resize(newCapacity, false);
 
+		for (int i = oldCapacity; i < newCapacity - 1; ++i)
+		{
+			nodes[i].m_next = i + 1;
+			nodes[i].m_hieght = -1;
+		}
+		nodes[newCapacity - 1].m_next = NULL_NODE;
+		nodes[newCapacity - 1].m_hieght = -1;
+		freeList = oldCapacity;
 	}
 
-	return -1;
-}
+	int index = freeList;
+	freeList = nodes[index].m_next;
 
-int AABBDynamicTree::AllocateNode()
-{
-	int leaf;
-	if (freeList.empty())
-	{
-		//fatten aabb
-		std::shared_ptr<Node> newNode = std::make_shared<Node>();
-		nodes.emplace_back(newNode);
-		leaf = nodes.size() - 1;
-	}
-	else
-	{
-		leaf = freeList.front();
-		freeList.pop();
-	}
+	nodes[index].m_parent = NULL_NODE;
+	nodes[index].m_left = NULL_NODE;
+	nodes[index].m_right = NULL_NODE;
+	nodes[index].m_hieght = 0;
+	nodes[index].m_clientData = nullptr;
+	nodes[index].m_moved = false;
+	debugColliding[index] = false;
 
-	return leaf;
+	return index;
 }
 
 void AABBDynamicTree::FreeNode(int index)
 {
-	nodes[index]->m_clientData = nullptr;
-	nodes[index]->m_hieght = 0;
-	nodes[index]->m_left = -1;
-	nodes[index]->m_right = -1;
-	nodes[index]->m_parent = -1;
-	freeList.push(index);
+	nodes[index].m_clientData = nullptr;
+	nodes[index].m_hieght = -1;
+	nodes[index].m_moved = false;
+	nodes[index].m_left = NULL_NODE;
+	nodes[index].m_right = NULL_NODE;
+	nodes[index].m_next = freeList;
+	freeList = index;
 }
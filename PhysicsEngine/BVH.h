@@ -1,67 +1,270 @@
 #pragma once
 
 #include "RigidBody.h"
+#include "BVH4.h"
+#include "LBVH.h"
+#include "RayPacket.h"
+#include "WorkerPool.h"
+#include <functional>
 #include <memory>
-#include <queue>
 
-struct Node 
+#define NULL_NODE -1
+
+// Compact tree node. Nodes live contiguously in AABBDynamicTree::nodes and
+// only hold what traversal needs; drawing state is kept by the tree.
+struct Node
 {
 	AABB m_box;
 	RigidBody* m_clientData;
 
-	int m_left = -1;
-	int m_right = -1;
-	int m_parent;
-	int m_hieght;
+	union
+	{
+		int m_parent;
+		int m_next; // free list link while the node is unused
+	};
+	int m_left;
+	int m_right;
+	int m_hieght; // -1 when the node is on the free list
+	float m_margin; // leaf fattening, adapted to how often the body escapes
+	bool m_moved;  // leaf is waiting in the move buffer
+	CollisionFilter m_filter; // copy of the body's filter, tested before reading the other body
 
-	bool IsLeaf() { return m_left == -1 && m_right == -1; }
+	bool IsLeaf() const { return m_left == NULL_NODE; }
 };
 
 class AABBDynamicTree
 {
 public:
-	AABBDynamicTree(Shape* box) : aabbBox(box) {}
+	AABBDynamicTree(Shape* box);
 	~AABBDynamicTree();
 
-	void Insert(RigidBody* data);
-	void Remove(int index);
-	void Update();
+	/// @brief Add a body to the tree
+	/// @return Proxy id of the new leaf. It stays valid until Remove
+	int Insert(RigidBody* data);
+
+	/// @brief Add many bodies at once. The new proxies get their own binned SAH
+	/// subtree, inserted with a single descent, instead of one descent each.
+	/// A batch at least as large as the tree rebuilds the whole tree
+	/// @param proxyIds - Filled with the proxy id of each body, in order
+	void InsertBatch(const std::vector<RigidBody*>& bodies, std::vector<int>& proxyIds);
+
+	/// @brief Remove a proxy returned by Insert
+	void Remove(int proxyId);
+
+	/// @brief Reinsert a proxy using the current AABB of its body
+	void MoveProxy(int proxyId);
+
+	/// @brief Copy the filter of the body into the proxy, its pairs are found
+	/// again by the next UpdatePairs
+	void RefilterProxy(int proxyId);
+
+	/// @brief Reinsert a proxy if aabb escaped its fat box, or if the fat box
+	/// became much larger than needed
+	/// @param displacement - Expected motion this step (velocity * dt). The fat
+	/// box is stretched along it so moving bodies stay inside for longer
+	/// @return True if the proxy was reinserted
+	bool UpdateProxy(int proxyId, const AABB& aabb, const glm::vec3& displacement);
+
+	/// @brief Find new pairs for the proxies moved since the last call and
+	/// report every pair currently overlapping. Pairs between proxies that
+	/// did not move are kept from the previous call without any traversal
+	/// @param callback - Called with the two proxy ids of each pair
+	void UpdatePairs(const std::function<void(int, int)>& callback);
+
+	/// @brief UpdatePairs that also pairs this tree against a tree of static
+	/// proxies. Static proxies only cost work here when they are moved
+	/// @param staticCallback - Called with (proxy in this tree, proxy in staticTree)
+	void UpdatePairs(AABBDynamicTree& staticTree, const std::function<void(int, int)>& callback,
+		const std::function<void(int, int)>& staticCallback);
+
+	/// @brief Report every leaf whose fat box overlaps aabb
+	/// @param callback - Called with the proxy id, return false to stop
+	void Query(const AABB& aabb, const std::function<bool(int)>& callback);
+
+	/// @brief Report every leaf whose fat box touches the sphere
+	/// @param callback - Called with the proxy id, return false to stop
+	void QuerySphere(const glm::vec3& center, float radius, const std::function<bool(int)>& callback);
+
+	/// @brief Report every leaf whose fat box is at least partly inside the
+	/// frustum. Planes a node is fully inside are not tested again below it
+	/// @param callback - Called with the proxy id, return false to stop
+	void QueryFrustum(const Frustum& frustum, const std::function<bool(int)>& callback);
+
+	/// @brief Report every leaf whose fat box is hit by the ray origin + t * direction
+	/// @param callback - Called with the proxy id and the entry t. Returns the new
+	/// maxT to clip the ray, 0 stops the cast
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(int, float)>& callback);
+
+	/// @brief RayCast for a packet of rays sharing one traversal. A node is
+	/// visited while any ray of the packet still hits it
+	/// @param callback - Called with the lane, the proxy id and the entry t.
+	/// Returns the new maxT of that ray, 0 stops the ray
+	void RayCastPacket(RayPacket& packet, const std::function<float(int, int, float)>& callback);
+
+	/// @brief Number of proxies waiting in the move buffer
+	size_t GetMoveCount() const { return moveBuffer.size(); }
+
+	/// @brief Rebuild the hierarchy top-down with a binned SAH split, or with
+	/// the parallel linear builder when useLinearBuild is set.
+	/// Proxy ids and their fat boxes are kept, only internal nodes change
+	void Rebuild();
+
+	/// @brief Rebuild when the SAH cost grew past rebuildThreshold times the
+	/// cost right after the last rebuild. The cost is only measured once
+	/// enough proxies were (re)inserted since the last check
+	/// @return True if the tree was rebuilt
+	bool RebuildIfDegraded();
+
+	/// @brief Surface area heuristic cost : sum of internal node areas over root area
+	float ComputeSAHCost() const;
+
+	/// @brief Improve the SAH cost in place with tree rotations. Visits up to
+	/// maxNodes internal nodes, continuing where the last call stopped, and
+	/// swaps a child with a grandchild when that shrinks the child's box
+	/// @return Number of rotations applied
+	int Optimize(int maxNodes);
+
+	int GetProxyCount() const { return proxyCount; }
+
+	/// @brief Answer Query and RayCast from a 4-wide SIMD copy of the tree.
+	/// The copy is rebuilt by the first query after the tree changed
+	void SetWide(bool enable) { useWide = enable; wideDirty = true; }
+	bool IsWide() const { return useWide; }
+
+	float rebuildThreshold = 1.5f;
+	bool useLinearBuild = false; // Morton sorted LBVH : much faster rebuilds, worse SAH cost
+	int pairThreadCount = 0; // threads searching the moved proxies, 0 : one per hardware thread
+
+	/// @brief Threads of the parallel pair search and LBVH builds, kept
+	/// between steps. Trees can share one
+	std::shared_ptr<WorkerPool> workerPool = std::make_shared<WorkerPool>();
+
+	/// @brief Tested on pairs that passed the filters, called from the pair finding threads
+	std::function<bool(RigidBody*, RigidBody*)> pairFilter;
+
 	int Balance(int index);
 	void Draw(int programId);
-	int FindIndex(RigidBody* data);
 
-	AABB Union(const AABB& a, const AABB& b)
+	/// @brief Mark a node as colliding for debug drawing
+	void SetColliding(int index, bool colliding) { debugColliding[index] = colliding; }
+	void ClearColliding() { std::fill(debugColliding.begin(), debugColliding.end(), false); }
+
+	AABB Union(const AABB& a, const AABB& b) const
 	{
 		AABB c;
-		c.m_shape = aabbBox;
-		c.m_lower.x = std::min(std::min(a.m_lower.x, b.m_lower.x), std::min(a.m_upper.x, b.m_upper.x));
-		c.m_lower.y = std::min(std::min(a.m_lower.y, b.m_lower.y), std::min(a.m_upper.y, b.m_upper.y));
-		c.m_lower.z = std::min(std::min(a.m_lower.z, b.m_lower.z), std::min(a.m_upper.z, b.m_upper.z));
-		c.m_upper.x = std::max(std::max(a.m_lower.x, b.m_lower.x), std::max(a.m_upper.x, b.m_upper.x));
-		c.m_upper.y = std::max(std::max(a.m_lower.y, b.m_lower.y), std::max(a.m_upper.y, b.m_upper.y));
-		c.m_upper.z = std::max(std::max(a.m_lower.z, b.m_lower.z), std::max(a.m_upper.z, b.m_upper.z));
+		c.m_lower = glm::min(a.m_lower, b.m_lower);
+		c.m_upper = glm::max(a.m_upper, b.m_upper);
 		return c;
 	}
 
-	float Area(const AABB& a)
+	float Area(const AABB& a) const
 	{
 		glm::vec3 diff = a.m_upper - a.m_lower;
 		return (diff.x + diff.y + diff.z) * 2.0f;
 	}
 
-	std::vector<std::shared_ptr<Node>> nodes;
-	int rootIndex = -1;
+	std::vector<Node> nodes;
+	int rootIndex = NULL_NODE;
 private:
 
+	void InsertLeaf(int leaf);
+	void RemoveLeaf(int leaf);
+	void BufferMove(int proxyId);
+	void PrepareMoveBuffer();
+	void ClearMoveBuffer();
+	void FindPairs(AABBDynamicTree* staticTree, const std::function<void(int, int)>& callback,
+		const std::function<void(int, int)>& staticCallback);
+
+	/// @brief Search the pairs of one moved proxy. Only reads the trees, so
+	/// threads can run it on different proxies with their own buffers
+	void FindProxyPairs(int proxyId, const AABBDynamicTree* staticTree,
+		std::vector<std::pair<int, int>>& pairs, std::vector<std::pair<int, int>>& staticPairs) const;
+
+	/// @brief FindProxyPairs for the whole move buffer, split in tasks pulled by workers threads
+	void FindPairsParallel(const AABBDynamicTree* staticTree, int workers);
+
+	/// @brief Query that only reads the tree. The wide copy must be up to date
+	void QueryTree(const AABB& aabb, const std::function<bool(int)>& callback) const;
+	bool IsValidProxy(int proxyId) const { return nodes[proxyId].m_hieght == 0; }
+
+	/// @brief Filters of the two proxies, then pairFilter
+	bool ShouldPair(const Node& a, const Node& b) const
+	{
+		return a.m_filter.ShouldCollide(b.m_filter) && (!pairFilter || pairFilter(a.m_clientData, b.m_clientData));
+	}
+
+	void RefreshWide();
+
+	bool Rotate(int index);
+	void SwapNodes(int a, int b);
+	void Refit(int index);
+
 	int AllocateNode();
 	void FreeNode(int index);
 
 	Shape* aabbBox;
-	
-	std::queue<int> freeList;
+	std::vector<bool> debugColliding;
 
-	float extent = 0.2f;
+	std::vector<int> moveBuffer;
+	std::vector<std::pair<int, int>> pairBuffer;
+	std::vector<std::pair<int, int>> staticPairBuffer;
 
-};
+	//Parallel pair finding : each thread appends to its own buffers and every
+	//task remembers the range it wrote, the ranges are merged in task order
+	struct PairThread
+	{
+		std::vector<std::pair<int, int>> m_pairs;
+		std::vector<std::pair<int, int>> m_staticPairs;
+	};
 
+	struct PairTask
+	{
+		int m_thread;
+		int m_begin, m_end;
+		int m_staticBegin, m_staticEnd;
+	};
+
+	std::vector<PairThread> pairThreads;
+	std::vector<PairTask> pairTasks;
+
+	WideBVH wideTree;
+	bool useWide = false;
+	bool wideDirty = true;
+
+	int freeList = NULL_NODE;
+	int proxyCount = 0;
+	int insertsSinceCheck = 0;
+	float builtCost = 0.f;
+	int optimizeCursor = 0;
+
+	//Leaf copied out of the pool while building, kept contiguous for the partitions
+	struct BuildLeaf
+	{
+		AABB m_box;
+		glm::vec3 m_centroid;
+		int m_index;
+	};
+
+	/// @brief Build a binned SAH hierarchy over leaves
+	/// @return Index of the subtree root, its parent is not set
+	int BuildTree(const int* leaves, int count);
+	int BuildRange(BuildLeaf* leaves, int count);
+	int LinkRange(BuildLeaf* leaves, int count, int mid, const AABB& bounds);
+	std::vector<BuildLeaf> buildLeaves;
+
+	/// @brief Build with the LBVH builder
+	/// @return Index of the subtree root
+	int BuildLinear(const int* leaves, int count);
+	LinearBVH linearBuilder;
+	std::vector<int> linearNodes;
+
+	AABB FattenAABB(const AABB& aabb, float margin, const glm::vec3& displacement) const;
+
+	float extent = 0.2f;     // initial margin of a new proxy
+	float minExtent = 0.05f;
+	float maxExtent = 0.4f;
+	float displacementMultiplier = 4.0f;
+
+};
 
@@ -0,0 +1,228 @@
+#include "BVH4.h"
+#include "BVH.h"
+
+void WideBVH::Build(const Node* binaryNodes, int root)
+{
+	nodes.clear();
+
+	if (root == NULL_NODE)
+		return;
+
+	if (binaryNodes[root].IsLeaf())
+	{
+		nodes.emplace_back();
+		nodes[0].m_count = 1;
+		SetChild(0, 0, binaryNodes[root].m_box, ~root);
+		for (int i = 1; i < 4; ++i)
+			SetChild(0, i, binaryNodes[root].m_box, 0);
+		return;
+	}
+
+	BuildNode(binaryNodes, root);
+}
+
+int WideBVH::BuildNode(const Node* binaryNodes, int index)
+{
+	//Pull grandchildren up : open the internal child with the largest area
+	//until there are 4 children or only leaves left
+	int children[4] = { binaryNodes[index].m_left, binaryNodes[index].m_right };
+	int count = 2;
+	while (count < 4)
+	{
+		int best = -1;
+		float bestArea = -1.f;
+		for (int i = 0; i < count; ++i)
+		{
+			const Node& child = binaryNodes[children[i]];
+			if (child.IsLeaf())
+				continue;
+
+			glm::vec3 d = child.m_box.m_upper - child.m_box.m_lower;
+			float area = d.x * d.y + d.y * d.z + d.z * d.x;
+			if (area > bestArea)
+			{
+				bestArea = area;
+				best = i;
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		int opened = children[best];
+		children[best] = binaryNodes[opened].m_left;
+		children[count++] = binaryNodes[opened].m_right;
+	}
+
+	int wideIndex = (int)nodes.size();
+	nodes.emplace_back();
+	nodes[wideIndex].m_count = count;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		if (i >= count)
+		{
+			//unused slots copy the first box, the count masks them out
+			SetChild(wideIndex, i, binaryNodes[children[0]].m_box, 0);
+			continue;
+		}
+
+		const Node& child = binaryNodes[children[i]];
+		if (child.IsLeaf())
+			SetChild(wideIndex, i, child.m_box, ~children[i]);
+		else
+		{
+			//nodes can grow while building the child, index again afterwards
+			int wideChild = BuildNode(binaryNodes, children[i]);
+			SetChild(wideIndex, i, child.m_box, wideChild);
+		}
+	}
+
+	return wideIndex;
+}
+
+void WideBVH::SetChild(int wideIndex, int slot, const AABB& box, int child)
+{
+	WideNode& node = nodes[wideIndex];
+	node.m_minX[slot] = box.m_lower.x;
+	node.m_minY[slot] = box.m_lower.y;
+	node.m_minZ[slot] = box.m_lower.z;
+	node.m_maxX[slot] = box.m_upper.x;
+	node.m_maxY[slot] = box.m_upper.y;
+	node.m_maxZ[slot] = box.m_upper.z;
+	node.m_child[slot] = child;
+}
+
+int WideBVH::OverlapMask(const WideNode& node, const AABB& aabb) const
+{
+	int validMask = (1 << node.m_count) - 1;
+
+#ifdef PHYSICS_SSE
+	__m128 overlap = _mm_and_ps(
+		_mm_cmple_ps(_mm_loadu_ps(node.m_minX), _mm_set1_ps(aabb.m_upper.x)),
+		_mm_cmpge_ps(_mm_loadu_ps(node.m_maxX), _mm_set1_ps(aabb.m_lower.x)));
+	overlap = _mm_and_ps(overlap, _mm_and_ps(
+		_mm_cmple_ps(_mm_loadu_ps(node.m_minY), _mm_set1_ps(aabb.m_upper.y)),
+		_mm_cmpge_ps(_mm_loadu_ps(node.m_maxY), _mm_set1_ps(aabb.m_lower.y))));
+	overlap = _mm_and_ps(overlap, _mm_and_ps(
+		_mm_cmple_ps(_mm_loadu_ps(node.m_minZ), _mm_set1_ps(aabb.m_upper.z)),
+		_mm_cmpge_ps(_mm_loadu_ps(node.m_maxZ), _mm_set1_ps(aabb.m_lower.z))));
+
+	return _mm_movemask_ps(overlap) & validMask;
+#else
+	int mask = 0;
+	for (int i = 0; i < node.m_count; ++i)
+	{
+		if (node.m_minX[i] <= aabb.m_upper.x && node.m_maxX[i] >= aabb.m_lower.x &&
+			node.m_minY[i] <= aabb.m_upper.y && node.m_maxY[i] >= aabb.m_lower.y &&
+			node.m_minZ[i] <= aabb.m_upper.z && node.m_maxZ[i] >= aabb.m_lower.z)
+			mask |= 1 << i;
+	}
+	return mask & validMask;
+#endif
+}
+
+int WideBVH::RayMask(const WideNode& node, const glm::vec3& origin, const glm::vec3& invDir, float maxT, float* tEnter) const
+{
+	int validMask = (1 << node.m_count) - 1;
+
+#ifdef PHYSICS_SSE
+	__m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	__m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_minX), ox), ix);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_maxX), ox), ix);
+	__m128 tMin = _mm_min_ps(t0, t1);
+	__m128 tMax = _mm_max_ps(t0, t1);
+
+	t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_minY), oy), iy);
+	t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_maxY), oy), iy);
+	tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+	tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+
+	t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_minZ), oz), iz);
+	t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_maxZ), oz), iz);
+	tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+	tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+
+	tMin = _mm_max_ps(tMin, _mm_setzero_ps());
+	tMax = _mm_min_ps(tMax, _mm_set1_ps(maxT));
+
+	_mm_storeu_ps(tEnter, tMin);
+	return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) & validMask;
+#else
+	int mask = 0;
+	for (int i = 0; i < node.m_count; ++i)
+	{
+		AABB box;
+		box.m_lower = glm::vec3(node.m_minX[i], node.m_minY[i], node.m_minZ[i]);
+		box.m_upper = glm::vec3(node.m_maxX[i], node.m_maxY[i], node.m_maxZ[i]);
+		if (box.RayIntersect(origin, invDir, maxT, tEnter[i]))
+			mask |= 1 << i;
+	}
+	return mask & validMask;
+#endif
+}
+
+void WideBVH::Query(const AABB& aabb, const std::function<bool(int)>& callback) const
+{
+	if (nodes.empty())
+		return;
+
+	GrowableStack<int> stack;
+	stack.Push(0);
+
+	while (!stack.IsEmpty())
+	{
+		const WideNode& node = nodes[stack.Pop()];
+
+		int mask = OverlapMask(node, aabb);
+		for (int i = 0; i < 4; ++i)
+		{
+			if ((mask & (1 << i)) == 0)
+				continue;
+
+			if (node.m_child[i] < 0)
+			{
+				if (!callback(~node.m_child[i]))
+					return;
+			}
+			else
+				stack.Push(node.m_child[i]);
+		}
+	}
+}
+
+void WideBVH::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<float(int, float)>& callback) const
+{
+	if (nodes.empty())
+		return;
+
+	glm::vec3 invDir = 1.0f / direction;
+	float tEnter[4];
+
+	GrowableStack<int> stack;
+	stack.Push(0);
+
+	while (!stack.IsEmpty())
+	{
+		const WideNode& node = nodes[stack.Pop()];
+
+		int mask = RayMask(node, origin, invDir, maxT, tEnter);
+		for (int i = 0; i < 4; ++i)
+		{
+			if ((mask & (1 << i)) == 0)
+				continue;
+
+			if (node.m_child[i] < 0)
+			{
+				maxT = callback(~node.m_child[i], tEnter[i]);
+				if (maxT <= 0.f)
+					return;
+			}
+			else
+				stack.Push(node.m_child[i]);
+		}
+	}
+}
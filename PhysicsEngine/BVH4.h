@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Collider.h"
+#include "GrowableStack.h"
+#include "Simd.h"
+#include <functional>
+
+struct Node;
+
+// Read-only 4-wide copy of an AABBDynamicTree. The binary tree is collapsed
+// so every node holds up to 4 children, their bounds stored per axis
+// (structure of arrays) so one node is tested against a box or a ray with
+// a few SSE instructions instead of 4 separate box tests
+class WideBVH
+{
+public:
+	/// @brief Collapse the binary tree rooted at root into 4-wide nodes
+	void Build(const Node* binaryNodes, int root);
+
+	/// @brief Report every leaf whose box overlaps aabb. Only reads the copy,
+	/// so several threads can search it at once
+	/// @param callback - Called with the proxy id, return false to stop
+	void Query(const AABB& aabb, const std::function<bool(int)>& callback) const;
+
+	/// @brief Report every leaf whose box is hit by origin + t * direction
+	/// @param callback - Called with the proxy id and the entry t. Returns the
+	/// new maxT to clip the ray, 0 stops the cast
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(int, float)>& callback) const;
+
+	bool IsEmpty() const { return nodes.empty(); }
+
+private:
+	struct WideNode
+	{
+		float m_minX[4], m_minY[4], m_minZ[4];
+		float m_maxX[4], m_maxY[4], m_maxZ[4];
+		int m_child[4]; // wide node index, or ~proxyId for a leaf
+		int m_count;
+	};
+
+	int BuildNode(const Node* binaryNodes, int index);
+	void SetChild(int wideIndex, int slot, const AABB& box, int child);
+
+	/// @brief Bit i set if child i overlaps the box
+	int OverlapMask(const WideNode& node, const AABB& aabb) const;
+
+	/// @brief Bit i set if child i is hit by the ray, entry t written to tEnter[i]
+	int RayMask(const WideNode& node, const glm::vec3& origin, const glm::vec3& invDir, float maxT, float* tEnter) const;
+
+	std::vector<WideNode> nodes;
+};
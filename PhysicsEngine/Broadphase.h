@@ -0,0 +1,134 @@
+#pragma once
+
+#include "RigidBody.h"
+#include "RayPacket.h"
+#include <functional>
+
+enum class BroadphaseType
+{
+	TREE,
+	SAP,
+	GRID,
+	NUMTYPES
+};
+
+// Interface between the physics world and the structure finding pairs of
+// bodies whose AABBs overlap. The backend stores its proxy id in
+// RigidBody::m_proxyId and picks where to keep a body from IsDynamic()
+class Broadphase
+{
+public:
+	virtual ~Broadphase() {}
+
+	/// @brief Add a body using its current AABB
+	virtual void AddProxy(RigidBody* body) = 0;
+
+	/// @brief Add many bodies at once, backends that can build their structure
+	/// in one pass override this
+	virtual void AddProxies(const std::vector<RigidBody*>& bodies)
+	{
+		for (RigidBody* body : bodies)
+			AddProxy(body);
+	}
+
+	/// @brief Remove a body added with AddProxy
+	virtual void RemoveProxy(RigidBody* body) = 0;
+
+	/// @brief Update a body that was moved by hand (editor, reset)
+	virtual void MoveProxy(RigidBody* body) = 0;
+
+	/// @brief Copy the changed m_filter of a body into its proxy. Pairs it no
+	/// longer allows are gone and the ones it now allows are found by the
+	/// next UpdatePairs
+	virtual void RefilterProxy(RigidBody* body) = 0;
+
+	/// @brief Extra test for the pairs that passed the collision filters,
+	/// return false to drop the pair before the narrowphase. The tree calls
+	/// it from its pair finding threads. Like the filters it is only applied
+	/// when a pair is found, change it before adding bodies or refilter them
+	virtual void SetPairFilter(const std::function<bool(RigidBody*, RigidBody*)>& filter) { pairFilter = filter; }
+
+	/// @brief Per step update of a dynamic body
+	/// @param displacement - Expected motion this step (velocity * dt)
+	virtual void UpdateProxy(RigidBody* body, const glm::vec3& displacement) = 0;
+
+	/// @brief Bring the pair set up to date with the proxy updates of this step
+	virtual void UpdatePairs() = 0;
+
+	/// @brief Report the pairs found by the last UpdatePairs, a dynamic body first
+	/// @param callback - Returns true if the pair is really touching (debug drawing)
+	virtual void ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback) = 0;
+
+	/// @brief Report every body whose broadphase box overlaps aabb. The queries
+	/// and ray casts keep no traversal state, a callback may start another one
+	/// @param callback - Return false to stop
+	virtual void Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback) = 0;
+
+	/// @brief Report every body whose broadphase box touches the sphere. Backends
+	/// without a hierarchy search the sphere's box and test each candidate
+	/// @param callback - Return false to stop
+	virtual void QuerySphere(const glm::vec3& center, float radius, const std::function<bool(RigidBody*)>& callback)
+	{
+		AABB bounds;
+		bounds.m_lower = center - glm::vec3(radius);
+		bounds.m_upper = center + glm::vec3(radius);
+
+		Query(bounds, [&](RigidBody* body)
+			{
+				if (!body->m_collider->m_aabb.OverlapsSphere(center, radius))
+					return true;
+				return callback(body);
+			});
+	}
+
+	/// @brief Report every body whose broadphase box overlaps the box around the
+	/// frustum corners and is not outside any plane. The default searches
+	/// that box and tests the planes on each candidate
+	/// @param callback - Return false to stop
+	virtual void QueryFrustum(const Frustum& frustum, const std::function<bool(RigidBody*)>& callback)
+	{
+		Query(frustum.Bounds(), [&](RigidBody* body)
+			{
+				int planeMask = (1 << 6) - 1;
+				if (frustum.Classify(body->m_collider->m_aabb, planeMask) == FrustumTest::OUTSIDE)
+					return true;
+				return callback(body);
+			});
+	}
+
+	/// @brief Report every body whose broadphase box is hit by origin + t * direction
+	/// @param callback - Called with the body and the entry t. Returns the new
+	/// maxT to clip the ray, 0 stops the cast
+	virtual void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(RigidBody*, float)>& callback) = 0;
+
+	/// @brief RayCast for up to 8 rays at once. Backends with a hierarchy
+	/// traverse it once for the whole packet
+	/// @param callback - Called with the lane, the body and the entry t.
+	/// Returns the new maxT of that ray, 0 stops the ray
+	virtual void RayCastPacket(RayPacket& packet, const std::function<float(int, RigidBody*, float)>& callback)
+	{
+		for (int ray = 0; ray < packet.m_count; ++ray)
+		{
+			if (packet.m_maxT[ray] <= 0.f)
+				continue;
+
+			RayCast(packet.m_origin[ray], packet.m_direction[ray], packet.m_maxT[ray], [&](RigidBody* body, float t)
+				{
+					packet.m_maxT[ray] = callback(ray, body, t);
+					return packet.m_maxT[ray];
+				});
+		}
+	}
+
+	/// @brief Optimize the structure from scratch, if the backend supports it
+	virtual void Rebuild() {}
+
+	virtual void Draw(int programId) = 0;
+	virtual const char* GetName() const = 0;
+
+protected:
+	bool AcceptPair(RigidBody* bodyA, RigidBody* bodyB) const { return !pairFilter || pairFilter(bodyA, bodyB); }
+
+	std::function<bool(RigidBody*, RigidBody*)> pairFilter;
+};
@@ -4,30 +4,30 @@ using namespace gl;
 
 #include "Collider.h"
 
-void AABB::Draw(int programId)
+void AABB::Draw(int programId, Shape* shape, bool colliding) const
 {
 	glm::vec3 pos = (m_upper + m_lower) * 0.5f;
 	glm::vec3 scale = (m_upper - m_lower) * 0.5f;
-	m_trans = Translate(pos.x, pos.y, pos.z) * Scale(scale.x, scale.y, scale.z);
+	glm::mat4 trans = Translate(pos.x, pos.y, pos.z) * Scale(scale.x, scale.y, scale.z);
 
 	glm::vec3 color = { 0,1,0 };
-	if (isColliding)
+	if (colliding)
 		color = { 1,0,0 };
 
 	int loc = glGetUniformLocation(programId, "lineColor");
 	glUniform3fv(loc, 1, &color[0]);
 
 	loc = glGetUniformLocation(programId, "ModelTr");
-	glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(m_trans));
+	glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(trans));
 
-	glm::mat4 inv = glm::inverse(m_trans);
+	glm::mat4 inv = glm::inverse(trans);
 	loc = glGetUniformLocation(programId, "NormalTr");
 	glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(inv));
 
 	loc = glGetUniformLocation(programId, "mode");
 	glUniform1i(loc, 1);
 
-	m_shape->DrawVAO(true);
+	shape->DrawVAO(true);
 }
 
 void AABB::Update(const glm::vec3& p, const glm::vec3& s, const glm::quat& r)
@@ -54,13 +54,14 @@ void AABB::Update(const glm::vec3& p, const glm::vec3& s, const glm::quat& r)
 	bMin[1] = bMax[1] = trans.y;
 	bMin[2] = bMax[2] = trans.z;
 
+	//glm matrices are column major : rot[j][i] is row i, column j
 	float a, b;
 	for (int i = 0; i < 3; ++i)
 	{
 		for (int j = 0; j < 3; ++j)
 		{
-			a = rot[i][j] * aMin[j];
-			b = rot[i][j] * aMax[j];
+			a = rot[j][i] * aMin[j];
+			b = rot[j][i] * aMax[j];
 
 			if (a < b)
 			{
@@ -79,6 +80,50 @@ void AABB::Update(const glm::vec3& p, const glm::vec3& s, const glm::quat& r)
 	m_upper = { bMax[0], bMax[1], bMax[2] };
 }
 
+Frustum Frustum::FromMatrix(const glm::mat4& viewProj)
+{
+	//Gribb / Hartmann : each plane is the last row plus or minus another row
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+
+	Frustum frustum;
+	for (int i = 0; i < 3; ++i)
+	{
+		frustum.m_planes[2 * i] = rows[3] + rows[i];
+		frustum.m_planes[2 * i + 1] = rows[3] - rows[i];
+	}
+
+	for (glm::vec4& plane : frustum.m_planes)
+		plane /= glm::length(glm::vec3(plane));
+
+	return frustum;
+}
+
+AABB Frustum::Bounds() const
+{
+	AABB bounds;
+	bounds.m_lower = glm::vec3(FLT_MAX);
+	bounds.m_upper = glm::vec3(-FLT_MAX);
+
+	//every corner is where one plane of each opposite pair meets
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		const glm::vec4& a = m_planes[0 + (corner & 1)];
+		const glm::vec4& b = m_planes[2 + ((corner >> 1) & 1)];
+		const glm::vec4& c = m_planes[4 + ((corner >> 2) & 1)];
+
+		glm::vec3 na(a), nb(b), nc(c);
+		glm::vec3 bc = glm::cross(nb, nc);
+		glm::vec3 p = -(a.w * bc + b.w * glm::cross(nc, na) + c.w * glm::cross(na, nb)) / glm::dot(na, bc);
+
+		bounds.m_lower = glm::min(bounds.m_lower, p);
+		bounds.m_upper = glm::max(bounds.m_upper, p);
+	}
+
+	return bounds;
+}
+
 void ConvexCollider::ConvexFindFurthestPoint(const glm::vec3& direction, glm::vec3& result)
 {
 	float maxDist = -FLT_MAX;
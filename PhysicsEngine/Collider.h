@@ -38,13 +38,11 @@ struct AABB
 	glm::vec3 m_lower;
 	glm::vec3 m_upper;
 
-	glm::mat4 m_trans;
-	bool isColliding = false;
+	/// @brief Draw the box as wireframe with the given unit box shape
+	/// (drawing data is owned by the caller so the box stays compact)
+	void Draw(int programId, Shape* shape, bool colliding) const;
 
-	Shape* m_shape;
-	void Draw(int programId);
-
-	bool Contains(const glm::vec3& p)
+	bool Contains(const glm::vec3& p) const
 	{
 		return (
 			p.x >= m_lower.x &&
@@ -56,14 +54,97 @@ struct AABB
 			);
 	}
 
-	bool Contains(const AABB& r)
+	bool Contains(const AABB& r) const
 	{
 		return (Contains(r.m_lower) && Contains(r.m_upper));
 	}
 
+	bool Overlaps(const AABB& r) const
+	{
+		return (
+			m_lower.x <= r.m_upper.x &&
+			m_upper.x >= r.m_lower.x &&
+			m_lower.y <= r.m_upper.y &&
+			m_upper.y >= r.m_lower.y &&
+			m_lower.z <= r.m_upper.z &&
+			m_upper.z >= r.m_lower.z
+			);
+	}
+
+	/// @brief Slab test of the ray origin + t * dir, t in [0, maxT]
+	/// @param invDir - 1 / dir, computed once per ray
+	/// @param tEnter - Where the ray enters the box, 0 if it starts inside
+	bool RayIntersect(const glm::vec3& origin, const glm::vec3& invDir, float maxT, float& tEnter) const
+	{
+		glm::vec3 t0 = (m_lower - origin) * invDir;
+		glm::vec3 t1 = (m_upper - origin) * invDir;
+		glm::vec3 tMin = glm::min(t0, t1);
+		glm::vec3 tMax = glm::max(t0, t1);
+
+		tEnter = std::max(std::max(tMin.x, tMin.y), std::max(tMin.z, 0.f));
+		float tExit = std::min(std::min(tMax.x, tMax.y), std::min(tMax.z, maxT));
+		return tEnter <= tExit;
+	}
+
+	/// @brief True if the sphere touches the box
+	bool OverlapsSphere(const glm::vec3& center, float radius) const
+	{
+		glm::vec3 closest = glm::clamp(center, m_lower, m_upper);
+		glm::vec3 d = center - closest;
+		return glm::dot(d, d) <= radius * radius;
+	}
+
 	void Update(const glm::vec3& p, const glm::vec3& s, const glm::quat& r);
 };
 
+enum class FrustumTest
+{
+	OUTSIDE,
+	INTERSECT,
+	INSIDE
+};
+
+// Six planes facing inward (left, right, bottom, top, near, far), a point p
+// is inside a plane when dot(normal, p) + d >= 0
+struct Frustum
+{
+	glm::vec4 m_planes[6]; // xyz normal, w d
+
+	/// @brief Extract the planes of a projection * view matrix (OpenGL clip space)
+	static Frustum FromMatrix(const glm::mat4& viewProj);
+
+	/// @brief Test the box against the planes whose bit is set in planeMask
+	/// @param planeMask - In : planes to test. Out : planes the box straddles,
+	/// children of a box only need those
+	FrustumTest Classify(const AABB& box, int& planeMask) const
+	{
+		glm::vec3 center = (box.m_lower + box.m_upper) * 0.5f;
+		glm::vec3 half = (box.m_upper - box.m_lower) * 0.5f;
+
+		int straddled = 0;
+		for (int i = 0; i < 6; ++i)
+		{
+			if ((planeMask & (1 << i)) == 0)
+				continue;
+
+			glm::vec3 normal(m_planes[i]);
+			float distance = glm::dot(normal, center) + m_planes[i].w;
+			float radius = glm::dot(half, glm::abs(normal));
+
+			if (distance < -radius)
+				return FrustumTest::OUTSIDE;
+			if (distance < radius)
+				straddled |= 1 << i;
+		}
+
+		planeMask = straddled;
+		return straddled ? FrustumTest::INTERSECT : FrustumTest::INSIDE;
+	}
+
+	/// @brief Box around the 8 corners, for backends that can only search boxes
+	AABB Bounds() const;
+};
+
 enum class BoundingType
 {
 	SPHERE,
@@ -218,7 +299,18 @@ public:
 			for (size_t j = 0; j < curr_face.size(); ++j)
 			{
 				size_t next = (j + 1)% curr_face.size();
-				m_edges.push_back(std::make_pair(std::make_pair(j, next), i));
+				m_edges.push_back(std::make_pair(std::make_pair(curr_face[j], curr_face[next]), i));
+			}
+		}
+
+		//faces wind the same way, the neighbour face walks the edge backward
+		m_edgeTwins.resize(m_edges.size());
+		for (size_t i = 0; i < m_edges.size(); ++i)
+		{
+			for (size_t j = 0; j < m_edges.size(); ++j)
+			{
+				if (m_edges[j].first.first == m_edges[i].first.second && m_edges[j].first.second == m_edges[i].first.first)
+					m_edgeTwins[i] = j;
 			}
 		}
 	}
@@ -243,7 +335,9 @@ public:
 	std::vector<glm::vec3> m_vertices;
 							//face indices, normal
 	std::vector<std::pair<std::vector<size_t>, glm::vec3>> m_faces;
+							//(start, end) vertex indices, face
 	std::vector<std::pair<std::pair<size_t,size_t>, size_t>> m_edges;
+	std::vector<size_t> m_edgeTwins; // same edge in the other direction, on the neighbour face
 	
 
 };
@@ -4,174 +4,365 @@
 #include "SAT.h"
 #include "GJKEPA.h"
 #include "SphereCollision.h"
+#include <algorithm>
 #include <list>
 
-inline int CollisionInQueueAlready(RigidBody* a, RigidBody* b
-	, std::vector<std::shared_ptr<CollisionData>>& colQueue)
+//Axes of two boxes : the faces of a and b are 0-2 and 3-5, edge i of a
+//against edge j of b is 6 + 3i + j
+
+/// @brief Box axis held by cache, -1 if none
+static int BoxAxisIndex(const SeparatingAxisCache& cache)
 {
-	for (int i = 0; i < colQueue.size(); i++) {
-		if (colQueue[i]->a == a && colQueue[i]->b == b) {
-			return i;
-		}
+	switch (cache.m_type)
+	{
+	case SeparatingAxisCache::FACE_A:
+		return cache.m_indexA;
+	case SeparatingAxisCache::FACE_B:
+		return 3 + cache.m_indexA;
+	case SeparatingAxisCache::EDGES:
+		return 6 + 3 * cache.m_indexA + cache.m_indexB;
+	default:
+		return -1;
 	}
-
-	return -1;
 }
 
+static void StoreBoxAxis(SeparatingAxisCache& cache, const Collider& a, const Collider& b, int axis, float depth)
+{
+	if (axis < 3)
+		StoreAxis(cache, a, b, SeparatingAxisCache::FACE_A, axis, 0, depth);
+	else if (axis < 6)
+		StoreAxis(cache, a, b, SeparatingAxisCache::FACE_B, axis - 3, 0, depth);
+	else
+		StoreAxis(cache, a, b, SeparatingAxisCache::EDGES, (axis - 6) / 3, (axis - 6) % 3, depth);
+}
 
-static bool intersectOBBOBB(RigidBody* a, RigidBody* b, ContactPoint& colData, std::vector<std::shared_ptr<CollisionData>>& colQueue)
+//Boxes, and convex colliders as long as they are the unit box through
+//m_objTr : their m_vertices and m_faces are not read
+static bool intersectOBBOBB(RigidBody* a, RigidBody* b, ContactPoint& colData, PairCache& pairCache)
 {
-	glm::vec2 minmax1;
-	glm::vec2 minmax2;
+	//Boxes and convex colliders are the unit box through m_objTr : its columns
+	//are the edge directions and the face normals are their cross products
+	glm::mat3 edgesA = glm::mat3(a->m_collider->m_objTr);
+	glm::mat3 edgesB = glm::mat3(b->m_collider->m_objTr);
+	glm::vec3 centerA = glm::vec3(a->m_collider->m_objTr[3]);
+	glm::vec3 centerB = glm::vec3(b->m_collider->m_objTr[3]);
+
+	glm::vec3 axes[15];
+	int axisCount = 0;
+	for (int i = 0; i < 3; ++i)
+		axes[axisCount++] = glm::cross(edgesA[(i + 1) % 3], edgesA[(i + 2) % 3]);
+	for (int i = 0; i < 3; ++i)
+		axes[axisCount++] = glm::cross(edgesB[(i + 1) % 3], edgesB[(i + 2) % 3]);
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 3; ++j)
+			axes[axisCount++] = glm::cross(edgesA[i], edgesB[j]);
+
+	//parallel edges give no axis
+	auto depthAlong = [&](int i, float& depth, glm::vec3& axis)
+	{
+		float length2 = glm::dot(axes[i], axes[i]);
+		if (length2 < 1e-8f)
+			return false;
+
+		axis = axes[i] / std::sqrt(length2);
+		glm::vec2 minmax1 = SATBox(axis, centerA, edgesA);
+		glm::vec2 minmax2 = SATBox(axis, centerB, edgesB);
+		depth = std::min(minmax1.y - minmax2.x, minmax2.y - minmax1.x);
+		return true;
+	};
+
+	//The axis of the last test is tried first
+	SeparatingAxisCache& cache = pairCache.GetAxisCache(a, b);
+	int cachedAxis = BoxAxisIndex(cache);
 
-	std::shared_ptr<OBBCollider> colA = std::static_pointer_cast<OBBCollider>(a->m_collider);
-	std::shared_ptr<OBBCollider> colB = std::static_pointer_cast<OBBCollider>(b->m_collider);
 	bool colliding = true;
-	// local axis of a (3)
-	for (int i = 0; i < colA->m_localAxis.size(); ++i)
+	bool decided = false;
+	int minAxis = -1;
+	float minDepth = FLT_MAX;
+	glm::vec3 normal(0.f);
+
+	//a separating axis is still likely to separate, and a resting contact
+	//keeps its axis while the boxes barely move relative to each other
+	bool resting = IsResting(cache, *a->m_collider, *b->m_collider);
+	float depth;
+	glm::vec3 axis;
+	if (cachedAxis != -1 && (cache.m_depth <= 0.f || resting) && depthAlong(cachedAxis, depth, axis))
 	{
-		minmax1 = SAT(colA->m_localAxis[i], a);
-		minmax2 = SAT(colA->m_localAxis[i], b);
-		if (!overlaps(minmax1, minmax2))
+		if (depth <= 0.f)
 		{
 			colliding = false;
-			break;
+			decided = true;
 		}
-
-		for (int j = 0; j < colB->m_localAxis.size(); ++j)
+		else if (resting)
 		{
-			glm::vec3 axis = glm::cross(colA->m_localAxis[i], colB->m_localAxis[j]);
-			if (axis == glm::vec3(0, 0, 0))
-				continue;
-
-			minmax1 = SAT(axis, a);
-			minmax2 = SAT(axis, b);
-			if (!overlaps(minmax1, minmax2))
-			{
-				colliding = false;
-				break;
-			}
+			minAxis = cachedAxis;
+			minDepth = depth;
+			normal = axis;
+			decided = true;
 		}
+		cache.m_depth = depth;
 	}
 
-	// local axis of b (3)
-	for (int i = 0; i < colB->m_localAxis.size(); ++i)
+	for (int i = 0; i < axisCount && !decided; ++i)
 	{
-		minmax1 = SAT(colB->m_localAxis[i], a);
-		minmax2 = SAT(colB->m_localAxis[i], b);
-		if (!overlaps(minmax1, minmax2))
+		if (!depthAlong(i, depth, axis))
+			continue;
+
+		if (depth <= 0.f)
 		{
 			colliding = false;
+			minAxis = i;
+			minDepth = depth;
 			break;
 		}
+
+		if (depth < minDepth)
+		{
+			minAxis = i;
+			minDepth = depth;
+			normal = axis;
+		}
+	}
+
+	if (!decided)
+		StoreBoxAxis(cache, *a->m_collider, *b->m_collider, minAxis, minDepth);
+
+	std::shared_ptr<CollisionData> manifold = pairCache.Find(a, b);
+	if (!manifold && !colliding)
+		return false;
+	else if (manifold && !colliding)
+	{
+		pairCache.Remove(a, b);
+		return false;
 	}
 
-	int inQueue = CollisionInQueueAlready(a, b, colQueue);
-	if (inQueue == -1 && !colliding) return false;
-	else if (inQueue != -1 && !colliding)
-		colQueue[inQueue]->collided = false; return false;
+	//normal from a to b
+	if (glm::dot(normal, b->m_collider->m_position - a->m_collider->m_position) < 0.f)
+		normal = -normal;
+
+	//Contacts at the vertices of each box inside the other one, which covers
+	//face contacts. Crossing edges have no such vertex, they get one contact
+	//in the middle of the overlap of the AABBs
+	std::vector<ContactPoint> cp;
+	glm::mat4 toLocalA = glm::inverse(a->m_collider->m_objTr);
+	glm::mat4 toLocalB = glm::inverse(b->m_collider->m_objTr);
+	glm::vec2 extentA = SATBox(normal, centerA, edgesA);
+	glm::vec2 extentB = SATBox(normal, centerB, edgesB);
+	const float inside = 1.0f + 1e-3f;
 
-	//simple AABB collision response
-	glm::vec3 posA = (a->m_collider->m_aabb.m_upper + a->m_collider->m_aabb.m_lower) * 0.5f;
-	glm::vec3 posB = (b->m_collider->m_aabb.m_upper + b->m_collider->m_aabb.m_lower) * 0.5f;
-	glm::vec3 scaleA = a->m_collider->m_aabb.m_upper - posA;
-	glm::vec3 scaleB = b->m_collider->m_aabb.m_upper - posB;
+	for (const glm::vec3& vertex : box_verts)
+	{
+		glm::vec3 pointA = glm::vec3(a->m_collider->m_objTr * glm::vec4(vertex, 1.f));
+		glm::vec3 local = glm::vec3(toLocalB * glm::vec4(pointA, 1.f));
+		if (std::abs(local.x) <= inside && std::abs(local.y) <= inside && std::abs(local.z) <= inside)
+		{
+			ContactPoint c;
+			c.contactNormal = normal;
+			c.penetrationDepth = glm::dot(pointA, normal) - extentB.x;
+			c.contactPointA = pointA;
+			c.contactPointB = pointA - normal * c.penetrationDepth;
+			cp.push_back(c);
+		}
 
-	glm::vec3 diffPos = posA - posB;
-	glm::vec3 absdiffPos = { std::abs(diffPos.x), std::abs(diffPos.y), std::abs(diffPos.z) };
+		glm::vec3 pointB = glm::vec3(b->m_collider->m_objTr * glm::vec4(vertex, 1.f));
+		local = glm::vec3(toLocalA * glm::vec4(pointB, 1.f));
+		if (std::abs(local.x) <= inside && std::abs(local.y) <= inside && std::abs(local.z) <= inside)
+		{
+			ContactPoint c;
+			c.contactNormal = normal;
+			c.penetrationDepth = extentA.y - glm::dot(pointB, normal);
+			c.contactPointB = pointB;
+			c.contactPointA = pointB + normal * c.penetrationDepth;
+			cp.push_back(c);
+		}
+	}
 
-	glm::vec3 penetration = scaleA + scaleB - absdiffPos;
-	glm::vec3 dir = diffPos - absdiffPos;
-	if (penetration.x < 0.5f)
+	if (cp.empty())
 	{
-		if (std::abs(dir.x) > DBL_EPSILON)
-			colData.contactNormal = { -1, 0,0 };
-		else
-			colData.contactNormal = { 1, 0,0 };
+		const AABB& boxA = a->m_collider->m_aabb;
+		const AABB& boxB = b->m_collider->m_aabb;
+		glm::vec3 middle = (glm::max(boxA.m_lower, boxB.m_lower) + glm::min(boxA.m_upper, boxB.m_upper)) * 0.5f;
+
+		ContactPoint c;
+		c.contactNormal = normal;
+		c.penetrationDepth = minDepth;
+		c.contactPointA = middle + normal * (minDepth * 0.5f);
+		c.contactPointB = middle - normal * (minDepth * 0.5f);
+		cp.push_back(c);
 	}
-	if (penetration.y < 0.5f)
+
+	//the deepest point is reported in colData
+	std::sort(cp.begin(), cp.end(), [](const ContactPoint& x, const ContactPoint& y)
+		{
+			return x.penetrationDepth > y.penetrationDepth;
+		});
+	colData = cp[0];
+
+	if (!manifold)
 	{
-		if (std::abs(dir.y) > DBL_EPSILON)
-			colData.contactNormal = { 0, -1,0 };
-		else
-			colData.contactNormal = { 0, 1,0 };
+		manifold = pairCache.Add(a, b);
+		manifold->a = a;
+		manifold->b = b;
 	}
-	if (penetration.z < 0.5f)
+	manifold->collided = true;
+
+	for (size_t i = 0; i < cp.size(); ++i)
+		manifold->InsertContactPoint(cp[i]);
+
+	return true;
+}
+
+static bool intersectBoxSphere(RigidBody* a, RigidBody* b, ContactPoint& colData, PairCache& pairCache)
+{
+	auto sphere = std::static_pointer_cast<SphereCollider>(b->m_collider);
+	const glm::mat4& boxTr = a->m_collider->m_objTr;
+	glm::vec3 center = glm::vec3(boxTr[3]);
+
+	//Closest point of the box to the sphere center, in the frame of the box
+	//axes with their lengths as half extents
+	glm::vec3 axes[3];
+	glm::vec3 halfExtents;
+	glm::vec3 local;
+	for (int i = 0; i < 3; ++i)
 	{
-		if (std::abs(dir.z) > DBL_EPSILON)
-			colData.contactNormal = { 0 , 0,-1 };
-		else
-			colData.contactNormal = { 0, 0,1 };
+		halfExtents[i] = glm::length(glm::vec3(boxTr[i]));
+		axes[i] = glm::vec3(boxTr[i]) / std::max(halfExtents[i], 1e-8f);
+		local[i] = glm::dot(sphere->m_position - center, axes[i]);
 	}
 
-	colData.contactNormal = -colData.contactNormal;
-	colData.penetrationDepth = std::min(penetration.x, std::min(penetration.y, penetration.z));
+	glm::vec3 clamped = glm::clamp(local, -halfExtents, halfExtents);
+	glm::vec3 closest = center;
+	for (int i = 0; i < 3; ++i)
+		closest += axes[i] * clamped[i];
 
-	if (inQueue != -1)
+	glm::vec3 normal;
+	float depth;
+	glm::vec3 toCenter = sphere->m_position - closest;
+	float distance2 = glm::dot(toCenter, toCenter);
+	if (distance2 > 1e-12f)
 	{
-		colQueue[inQueue]->InsertContactPoint(colData);
-		colQueue[inQueue]->collided = true;
+		float distance = std::sqrt(distance2);
+		normal = toCenter / distance;
+		depth = sphere->m_radius - distance;
 	}
 	else
 	{
-		auto manifold = std::make_shared<CollisionData>();
+		//center inside the box, push out through the nearest face
+		int face = 0;
+		float faceDistance = FLT_MAX;
+		for (int i = 0; i < 3; ++i)
+		{
+			float d = halfExtents[i] - std::abs(local[i]);
+			if (d < faceDistance)
+			{
+				faceDistance = d;
+				face = i;
+			}
+		}
+
+		normal = local[face] >= 0.f ? axes[face] : -axes[face];
+		closest = sphere->m_position + normal * faceDistance;
+		depth = sphere->m_radius + faceDistance;
+	}
+
+	bool colliding = depth > 0.f;
+	std::shared_ptr<CollisionData> manifold = pairCache.Find(a, b);
+	if (!manifold && !colliding)
+		return false;
+	else if (manifold && !colliding)
+	{
+		pairCache.Remove(a, b);
+		return false;
+	}
+
+	std::vector<ContactPoint> cp(1);
+	cp[0].contactNormal = normal;
+	cp[0].penetrationDepth = depth;
+	cp[0].contactPointA = closest;
+	cp[0].contactPointB = sphere->m_position - normal * sphere->m_radius;
+	colData = cp[0];
+
+	if (manifold)
+	{
+		manifold->contactPoints = cp;
+		manifold->collided = true;
+	}
+	else
+	{
+		manifold = pairCache.Add(a, b);
 		manifold->a = a;
 		manifold->b = b;
 		manifold->collided = true;
-		manifold->InsertContactPoint(colData);
-		colQueue.push_back(manifold);
+		manifold->contactPoints = cp;
 	}
 
 	return true;
-
 }
 
 
-static bool intersectConvexSphere(RigidBody* a, RigidBody* b, ContactPoint& colData, std::vector<std::shared_ptr<CollisionData>>& colQueue)
+static bool intersectConvexSphere(RigidBody* a, RigidBody* b, ContactPoint& /*colData*/, PairCache& pairCache)
 {
 
-	int inQueue = CollisionInQueueAlready(a, b, colQueue);
+	std::shared_ptr<CollisionData> manifold = pairCache.Find(a, b);
 	
+	//GJK from the pair's last simplex between the hull and the sphere center,
+	//exact at edges and corners where the face axes alone overlap. Only a
+	//center inside the hull needs the face SAT
 	std::vector<ContactPoint> cp;
-	bool colliding = SATSphereConvex(a, b, cp);
-	if (inQueue == -1 && !colliding)
+	bool colliding;
+	GJKDistanceResult distance;
+	if (GJKDistance(a, b, distance, &pairCache.GetGJKCache(a, b)))
+	{
+		colliding = distance.m_distance < 0.f;
+		if (colliding)
+		{
+			ContactPoint c;
+			c.contactNormal = distance.m_normal;
+			c.penetrationDepth = -distance.m_distance;
+			c.contactPointA = distance.m_pointA;
+			c.contactPointB = distance.m_pointB;
+			cp.push_back(c);
+		}
+	}
+	else
+		colliding = SATSphereConvex(a, b, cp);
+	if (!manifold && !colliding)
 		return false;
-	else if (inQueue != -1 && !colliding)
+	else if (manifold && !colliding)
 	{
-		colQueue.erase(colQueue.begin() + inQueue);
+		pairCache.Remove(a, b);
 		return false;
 	}
 
-	if (inQueue != -1)
+	if (manifold)
 	{
-		colQueue[inQueue]->contactPoints = cp;
-		colQueue[inQueue]->collided = true;
+		manifold->contactPoints = cp;
+		manifold->collided = true;
 	}
 	else
 	{
-		auto col = std::make_shared<CollisionData>();
-		col->a = a;
-		col->b = b;
-		col->collided = true;
-		col->contactPoints = cp;
-		colQueue.push_back(col);
+		manifold = pairCache.Add(a, b);
+		manifold->a = a;
+		manifold->b = b;
+		manifold->collided = true;
+		manifold->contactPoints = cp;
 	}
 	
 	return true;
 
 }
 
-static bool intersectSphereSphere(RigidBody* a, RigidBody* b, ContactPoint& colData, std::vector<std::shared_ptr<CollisionData>>& colQueue)
+static bool intersectSphereSphere(RigidBody* a, RigidBody* b, ContactPoint& /*colData*/, PairCache& pairCache)
 {
 	bool colliding = SphereSphereCollision(a, b);
 
-	int inQueue = CollisionInQueueAlready(a, b, colQueue);
+	std::shared_ptr<CollisionData> manifold = pairCache.Find(a, b);
 
-	if (inQueue == -1 && !colliding)
+	if (!manifold && !colliding)
 		return false;
-	else if (inQueue != -1 && !colliding)
+	else if (manifold && !colliding)
 	{
-		colQueue.erase(colQueue.begin() + inQueue);
+		pairCache.Remove(a, b);
 		return false;
 	}
 
@@ -179,49 +370,48 @@ static bool intersectSphereSphere(RigidBody* a, RigidBody* b, ContactPoint& colD
 	SphereSphereContactPoint(a, b, cp);
 	
 
-	if (inQueue != -1)
+	if (manifold)
 	{
 		for (size_t i = 0; i < cp.size(); ++i)
-			colQueue[inQueue]->InsertContactPoint(cp[i]);
-		colQueue[inQueue]->collided = true;
+			manifold->InsertContactPoint(cp[i]);
+		manifold->collided = true;
 	}
 	else
 	{
-		auto col = std::make_shared<CollisionData>();
-		col->a = a;
-		col->b = b;
-		col->collided = true;
-		col->contactPoints = cp;
-		colQueue.push_back(col);
+		manifold = pairCache.Add(a, b);
+		manifold->a = a;
+		manifold->b = b;
+		manifold->collided = true;
+		manifold->contactPoints = cp;
 	}
 
 
 	return true;
 }
 
-static bool intersectWithConvex(RigidBody* a, RigidBody* b, ContactPoint& colData, std::vector<std::shared_ptr<CollisionData>>& colQueue)
+static bool intersectWithConvex(RigidBody* a, RigidBody* b, ContactPoint& /*colData*/, PairCache& pairCache)
 {
 	
 	std::vector<ContactPoint> cp;
 	bool flip;
-	bool colliding = FindSparatingAxis(a, b, flip, cp);
+	bool colliding = FindSparatingAxis(a, b, flip, cp, pairCache.GetAxisCache(a, b));
 
-	int inQueue = CollisionInQueueAlready(a, b, colQueue);
+	std::shared_ptr<CollisionData> manifold = pairCache.Find(a, b);
 	
-	if (inQueue == -1 && !colliding)
+	if (!manifold && !colliding)
 		return false;
-	else if (inQueue != -1 && !colliding)
+	else if (manifold && !colliding)
 		return false;
 
-	if (inQueue != -1)
+	if (manifold)
 	{
 		for (size_t i = 0; i < cp.size(); ++i)
-			colQueue[inQueue]->InsertContactPoint(cp[i]);
-		colQueue[inQueue]->collided = true;
+			manifold->InsertContactPoint(cp[i]);
+		manifold->collided = true;
 	}
 	else
 	{
-		auto col = std::make_shared<CollisionData>();
+		auto col = pairCache.Add(a, b);
 		if (flip)
 		{
 			col->a = b;
@@ -236,31 +426,66 @@ static bool intersectWithConvex(RigidBody* a, RigidBody* b, ContactPoint& colDat
 
 		for (size_t i = 0; i < cp.size(); ++i)
 			col->InsertContactPoint(cp[i]);
-
-		colQueue.push_back(col);
 	}
 	
 	return true;
 }
 
 
-static bool intersect(RigidBody* a, RigidBody* b, ContactPoint& colData, std::vector<std::shared_ptr<CollisionData>>& colQueue)
+// Narrowphase test of a pair of bodies, a has the first type it was registered with
+typedef bool (*IntersectFunction)(RigidBody* a, RigidBody* b, ContactPoint& colData, PairCache& pairCache);
+
+// Narrowphase function of every pair of collider types, one indirect call
+// per pair. A function registered for (A, B) also serves (B, A) : it is
+// called with the bodies swapped, its manifold keeps that order and colData
+// is flipped back to the caller's order. A new collider type gets a
+// BoundingType before NUMSHAPES and a Register call for each type it meets
+class CollisionDispatcher
 {
-	if (a->m_collider->m_type == BoundingType::CONVEX && b->m_collider->m_type == BoundingType::CONVEX)
-		return intersectWithConvex(a, b, colData, colQueue);
+public:
+	/// @brief Use function for typeA against typeB, and swapped for typeB against typeA.
+	/// Box functions such as intersectOBBOBB read a collider as the unit box
+	/// through m_objTr and may only take CONVEX while ConvexCollider is built
+	/// from box_verts. A general hull needs the convex SAT
+	void Register(BoundingType typeA, BoundingType typeB, IntersectFunction function)
+	{
+		table[(int)typeA][(int)typeB] = { function, false };
+		if (typeA != typeB)
+			table[(int)typeB][(int)typeA] = { function, true };
+	}
 
-	else if (a->m_collider->m_type == BoundingType::CONVEX && b->m_collider->m_type == BoundingType::CONVEX)
-		return intersectOBBOBB(a, b, colData, colQueue);
+	bool IsRegistered(BoundingType typeA, BoundingType typeB) const
+	{
+		return table[(int)typeA][(int)typeB].m_function != nullptr;
+	}
 
-	else if (a->m_collider->m_type == BoundingType::CONVEX && b->m_collider->m_type == BoundingType::SPHERE)
-		return intersectConvexSphere(a, b, colData, colQueue);
+	/// @return True if the bodies touch. Pairs with no function never do
+	bool Intersect(RigidBody* a, RigidBody* b, ContactPoint& colData, PairCache& pairCache) const
+	{
+		const Entry& entry = table[(int)a->m_collider->m_type][(int)b->m_collider->m_type];
+		if (!entry.m_function)
+			return false;
 
-	else if (a->m_collider->m_type == BoundingType::SPHERE && b->m_collider->m_type == BoundingType::CONVEX)
-		return intersectConvexSphere(b, a, colData, colQueue);
+		if (!entry.m_swap)
+			return entry.m_function(a, b, colData, pairCache);
 
-	else if (a->m_collider->m_type == BoundingType::SPHERE && b->m_collider->m_type == BoundingType::SPHERE)
-		return intersectSphereSphere(a, b, colData, colQueue);
-}
+		if (!entry.m_function(b, a, colData, pairCache))
+			return false;
+
+		colData.contactNormal = -colData.contactNormal;
+		std::swap(colData.contactPointA, colData.contactPointB);
+		return true;
+	}
+
+private:
+	struct Entry
+	{
+		IntersectFunction m_function = nullptr;
+		bool m_swap = false; // registered for the other order
+	};
+
+	Entry table[(int)BoundingType::NUMSHAPES][(int)BoundingType::NUMSHAPES];
+};
 
 inline bool intersectAABB(const AABB& a, const AABB& b)
 {
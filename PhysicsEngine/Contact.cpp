@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Contact.h"
+#include <algorithm>
 
 void CollisionData::InsertContactPoint(const ContactPoint& cp)
 {
@@ -60,3 +61,189 @@ void CollisionData::ChangeContactPoint(const ContactPoint& cp)
 
 }
 
+
+void PairCache::NewFrame()
+{
+	manifolds.clear();
+	++frame;
+}
+
+void PairCache::Clear()
+{
+	slots.clear();
+	manifolds.clear();
+	usedSlots = 0;
+}
+
+std::shared_ptr<CollisionData> PairCache::Find(RigidBody* a, RigidBody* b)
+{
+	if (slots.empty())
+		return nullptr;
+
+	if (a > b)
+		std::swap(a, b);
+
+	const Slot& slot = slots[FindSlot(a, b)];
+	if (slot.m_a != a || slot.m_b != b || slot.m_frame != frame)
+		return nullptr;
+
+	return slot.m_manifold;
+}
+
+std::shared_ptr<CollisionData> PairCache::Add(RigidBody* a, RigidBody* b)
+{
+	Slot& slot = Touch(a, b);
+	if (slot.m_frame == frame)
+		return slot.m_manifold;
+
+	//a stale manifold, even of another pair, is recycled
+	if (slot.m_manifold)
+	{
+		slot.m_manifold->contactPoints.clear();
+		slot.m_manifold->pointCount = 0;
+	}
+	else
+		slot.m_manifold = std::make_shared<CollisionData>();
+
+	slot.m_manifold->collided = false;
+	slot.m_frame = frame;
+	slot.m_index = (int)manifolds.size();
+	manifolds.push_back(slot.m_manifold);
+
+	return slot.m_manifold;
+}
+
+SeparatingAxisCache& PairCache::GetAxisCache(RigidBody* a, RigidBody* b)
+{
+	return TouchCaches(a, b).m_axis;
+}
+
+GJKCache& PairCache::GetGJKCache(RigidBody* a, RigidBody* b)
+{
+	return TouchCaches(a, b).m_gjk;
+}
+
+void PairCache::Remove(RigidBody* a, RigidBody* b)
+{
+	if (slots.empty())
+		return;
+
+	if (a > b)
+		std::swap(a, b);
+
+	Slot& slot = slots[FindSlot(a, b)];
+	if (slot.m_a != a || slot.m_b != b || slot.m_frame != frame)
+		return;
+
+	int index = slot.m_index;
+	slot.m_frame = frame - 1;
+	slot.m_index = -1;
+
+	int last = (int)manifolds.size() - 1;
+	if (index != last)
+	{
+		manifolds[index] = manifolds[last];
+		RigidBody* movedA = std::min(manifolds[index]->a, manifolds[index]->b);
+		RigidBody* movedB = std::max(manifolds[index]->a, manifolds[index]->b);
+		slots[FindSlot(movedA, movedB)].m_index = index;
+	}
+	manifolds.pop_back();
+}
+
+PairCache::Slot& PairCache::Touch(RigidBody* a, RigidBody* b)
+{
+	if (2 * (usedSlots + 1) > (int)slots.size())
+		Rehash();
+
+	if (a > b)
+		std::swap(a, b);
+
+	Slot& slot = slots[FindSlot(a, b)];
+	if (slot.m_a != a || slot.m_b != b)
+	{
+		//an empty slot, or a stale one of another pair whose axis is dropped
+		if (slot.m_a == nullptr)
+			++usedSlots;
+		slot.m_a = a;
+		slot.m_b = b;
+		slot.m_frame = frame - 1;
+		slot.m_index = -1;
+		slot.m_cacheOwner = nullptr;
+	}
+	slot.m_seen = frame;
+
+	return slot;
+}
+
+PairCache::Slot& PairCache::TouchCaches(RigidBody* a, RigidBody* b)
+{
+	Slot& slot = Touch(a, b);
+	if (slot.m_cacheOwner != a)
+	{
+		slot.m_cacheOwner = a;
+		slot.m_axis = SeparatingAxisCache();
+		slot.m_gjk = GJKCache();
+	}
+	return slot;
+}
+
+int PairCache::FindSlot(RigidBody* a, RigidBody* b) const
+{
+	//Slot holding (a, b), else the first slot not used this frame nor the
+	//last one on the probe sequence, else the empty slot ending it. Pairs of
+	//the last frame keep their caches until they are tested again
+	int mask = (int)slots.size() - 1;
+	int index = (int)(Hash(a, b) & mask);
+	int reuse = -1;
+
+	while (slots[index].m_a != nullptr)
+	{
+		const Slot& slot = slots[index];
+		if (slot.m_a == a && slot.m_b == b)
+			return index;
+
+		if (reuse == -1 && slot.m_seen + 1 < frame)
+			reuse = index;
+
+		index = (index + 1) & mask;
+	}
+
+	return reuse != -1 ? reuse : index;
+}
+
+void PairCache::Rehash()
+{
+	//Only pairs of this frame and the last one are worth keeping, the
+	//table is sized from them so it also shrinks after a big scene
+	int kept = 0;
+	for (const Slot& slot : slots)
+	{
+		if (slot.m_a != nullptr && slot.m_seen + 1 >= frame)
+			++kept;
+	}
+
+	int capacity = 64;
+	while (capacity < 4 * (kept + 1))
+		capacity *= 2;
+
+	std::vector<Slot> old;
+	old.swap(slots);
+	slots.resize(capacity);
+	usedSlots = 0;
+
+	//Kept pairs are all different and the new table holds no stale slot,
+	//so each goes to the first empty slot of its probe sequence
+	int mask = capacity - 1;
+	for (Slot& slot : old)
+	{
+		if (slot.m_a == nullptr || slot.m_seen + 1 < frame)
+			continue;
+
+		int index = (int)(Hash(slot.m_a, slot.m_b) & mask);
+		while (slots[index].m_a != nullptr)
+			index = (index + 1) & mask;
+
+		slots[index] = std::move(slot);
+		++usedSlots;
+	}
+}
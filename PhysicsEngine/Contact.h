@@ -1,6 +1,8 @@
 #pragma once
 #include "glm/glm.hpp"
+#include <glm/gtx/quaternion.hpp>
 #include <vector>
+#include <memory>
 
 class RigidBody;
 
@@ -30,5 +32,99 @@ struct CollisionData
 
 };
 
+// Axis that decided a pair the last time it was tested, kept while the
+// broadphase reports the pair whether it touched or not. Indices are faces
+// or edges of the colliders, or box axes for boxes
+struct SeparatingAxisCache
+{
+	enum Type { NONE, FACE_A, FACE_B, EDGES };
+
+	Type m_type = NONE;
+	int m_indexA = 0;
+	int m_indexB = 0;       // edge of b for EDGES
+	float m_depth = 0.f;    // last penetration, <= 0 : the axis separated the pair
+	glm::quat m_rotation;   // b relative to a when the axis was searched for
+	glm::vec3 m_position;
+};
+
+// GJK state of a pair kept between frames to seed the next search
+struct GJKCache
+{
+	glm::vec3 m_direction = glm::vec3(1.f, 0.f, 0.f); // from a to b, separating if the pair was apart
+
+	//Last simplex of the distance query, its points in the unit frames of a
+	//and b so it can be rebuilt where the bodies are now
+	glm::vec3 m_localA[4];
+	glm::vec3 m_localB[4];
+	int m_count = 0;
+};
+
+// Open addressing hash map from an unordered body pair to its manifold.
+// Slots carry the frame they were last used in : NewFrame makes every pair
+// stale at once without touching the table, and a pair found again reuses
+// the manifold it had before instead of allocating a new one. Pairs also
+// keep their last separating axis for as long as they are tested each frame
+class PairCache
+{
+public:
+	/// @brief Start a new frame, every manifold found so far goes stale
+	void NewFrame();
+
+	/// @brief Drop every pair and manifold, needed once bodies are deleted
+	void Clear();
+
+	/// @brief Manifold of (a, b) added this frame
+	/// @return nullptr if the pair has no manifold this frame
+	std::shared_ptr<CollisionData> Find(RigidBody* a, RigidBody* b);
+
+	/// @brief Add (a, b) to this frame's manifolds
+	/// @return The manifold, emptied. a and b are left for the caller to order
+	std::shared_ptr<CollisionData> Add(RigidBody* a, RigidBody* b);
+
+	/// @brief Remove (a, b) from this frame's manifolds, swapping the last one in
+	void Remove(RigidBody* a, RigidBody* b);
+
+	/// @brief Separating axis of (a, b) in this order, kept across frames
+	/// while the pair is tested every frame. A cache written for (b, a) is reset
+	SeparatingAxisCache& GetAxisCache(RigidBody* a, RigidBody* b);
+
+	/// @brief GJK state of (a, b) in this order, kept like the axis cache
+	GJKCache& GetGJKCache(RigidBody* a, RigidBody* b);
+
+	/// @brief Manifolds added this frame
+	std::vector<std::shared_ptr<CollisionData>>& GetManifolds() { return manifolds; }
+
+private:
+	struct Slot
+	{
+		RigidBody* m_a = nullptr; // nullptr : never used
+		RigidBody* m_b = nullptr;
+		std::shared_ptr<CollisionData> m_manifold;
+		unsigned int m_frame = 0;
+		unsigned int m_seen = 0; // last frame the pair was added or its axis used
+		int m_index = -1; // in manifolds while m_frame is the current frame
+		RigidBody* m_cacheOwner = nullptr; // first body of the pair the caches were written for
+		SeparatingAxisCache m_axis;
+		GJKCache m_gjk;
+	};
+
+	Slot& Touch(RigidBody* a, RigidBody* b);
+	Slot& TouchCaches(RigidBody* a, RigidBody* b);
+
+	int FindSlot(RigidBody* a, RigidBody* b) const;
+	void Rehash();
+
+	static size_t Hash(RigidBody* a, RigidBody* b)
+	{
+		size_t h = reinterpret_cast<size_t>(a) * 0x9E3779B1u;
+		return (h ^ (h >> 16)) + reinterpret_cast<size_t>(b) * 0x85EBCA77u;
+	}
+
+	std::vector<Slot> slots;
+	std::vector<std::shared_ptr<CollisionData>> manifolds;
+	int usedSlots = 0;
+	unsigned int frame = 1;
+};
+
 
 
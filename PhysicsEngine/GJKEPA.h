@@ -2,11 +2,32 @@
 #include "Collider.h"
 #include "Contact.h"
 #include "Helper.h"
+#include "ShapeCast.h"
+#include <initializer_list>
 
 #define GJK_EPA_MAX_ITER 32
 
+//Simplex of GJK on the stack, the newest point last
+struct GJKSimplex
+{
+	SupportVector m_points[4];
+	int m_count = 0;
+
+	GJKSimplex& operator=(std::initializer_list<SupportVector> points)
+	{
+		m_count = 0;
+		for (const SupportVector& point : points)
+			m_points[m_count++] = point;
+		return *this;
+	}
+
+	void Push(const SupportVector& point) { m_points[m_count++] = point; }
+	int Size() const { return m_count; }
+	const SupportVector& operator[](int i) const { return m_points[i]; }
+};
+
 
-static bool CheckLine(std::vector<SupportVector>& simplex, glm::vec3& direction)
+static bool CheckLine(GJKSimplex& simplex, glm::vec3& direction)
 {
 	SupportVector a = simplex[1];
 	SupportVector b = simplex[0];
@@ -25,7 +46,7 @@ static bool CheckLine(std::vector<SupportVector>& simplex, glm::vec3& direction)
 	return false;
 }
 
-static bool CheckTriangle(std::vector<SupportVector>& simplex, glm::vec3& direction)
+static bool CheckTriangle(GJKSimplex& simplex, glm::vec3& direction)
 {
 	SupportVector a = simplex[2];
 	SupportVector b = simplex[1];
@@ -66,7 +87,7 @@ static bool CheckTriangle(std::vector<SupportVector>& simplex, glm::vec3& direct
 	return false;
 }
 
-static bool CheckTetrahedron(std::vector<SupportVector>& simplex, glm::vec3& direction)
+static bool CheckTetrahedron(GJKSimplex& simplex, glm::vec3& direction)
 {
 	SupportVector a = simplex[3];
 	SupportVector b = simplex[2];
@@ -92,7 +113,9 @@ static bool CheckTetrahedron(std::vector<SupportVector>& simplex, glm::vec3& dir
 	return true;
 }
 
-static bool GJK(RigidBody* a, RigidBody* b, std::vector<SupportVector>& simplex)
+/// @brief Boolean GJK on the Minkowski difference a - b
+/// @param simplex - Tetrahedron around the origin if they overlap, for EPA
+static bool GJK(RigidBody* a, RigidBody* b, GJKSimplex& simplex)
 {
 	auto colA = a->m_collider;
 	auto colB = b->m_collider;
@@ -100,12 +123,11 @@ static bool GJK(RigidBody* a, RigidBody* b, std::vector<SupportVector>& simplex)
 	glm::vec3 direction = { 1,0,0 };
 	SupportVector supportVec = GetSupportVector(direction, colA, colB);
 
-	simplex.push_back(supportVec);
+	simplex = { supportVec };
 
 	direction = -supportVec.support;
 
-	bool result = false;
-	while (!result)
+	for (int iterations = 0; iterations < GJK_EPA_MAX_ITER; ++iterations)
 	{
 		supportVec = GetSupportVector(direction, colA, colB);
 
@@ -113,23 +135,148 @@ static bool GJK(RigidBody* a, RigidBody* b, std::vector<SupportVector>& simplex)
 		if (glm::dot(supportVec.support, direction) <= 0)
 			return false;
 
-		simplex.push_back(supportVec);
-	
-		if (simplex.size() > 4)
-			simplex.pop_back();
+		simplex.Push(supportVec);
+
+		if (simplex.Size() == 2) //line
+			CheckLine(simplex, direction);
+
+		else if (simplex.Size() == 3) // triangle
+			CheckTriangle(simplex, direction);
+
+		else if (CheckTetrahedron(simplex, direction)) // tetrahedron
+			return true;
+	}
+
+	return false;
+}
 
-		if (simplex.size() == 2) //line
-			result = CheckLine(simplex, direction);
+struct GJKDistanceResult
+{
+	float m_distance = 0.f;   // < 0 : sphere radii overlap by that much
+	glm::vec3 m_pointA;       // closest points, on the surfaces
+	glm::vec3 m_pointB;
+	glm::vec3 m_normal;       // from a to b
+};
+
+/// @brief Distance GJK (van den Bergen) : closest point to the origin of the
+/// Minkowski difference b - a, without EPA. Boxes and convex colliders use
+/// the supports of ShapeSupport, spheres are searched as their centers and
+/// their radii come off the distance, so shallow sphere contacts get their
+/// depth and normal from the search too
+/// @param cache - Simplex of the pair's last query, rebuilt at the current
+/// poses to start from : in a coherent scene it already holds the closest
+/// features. Updated with the final simplex and the normal
+/// @return True if the shapes are apart once sphere radii are left out,
+/// result holds their closest points
+static bool GJKDistance(RigidBody* a, RigidBody* b, GJKDistanceResult& result, GJKCache* cache = nullptr)
+{
+	const Collider& colA = *a->m_collider;
+	const Collider& colB = *b->m_collider;
+	const float tolerance = 1e-4f;
 
-		else if (simplex.size() == 3) // triangle
-			result = CheckTriangle(simplex, direction);
+	auto core = [](const Collider& shape, const glm::vec3& direction)
+	{
+		return shape.m_type == BoundingType::SPHERE ? shape.m_position : ShapeSupport(shape, shape.m_position, direction);
+	};
+	float radiusA = colA.m_type == BoundingType::SPHERE ? colA.m_scale.x : 0.f;
+	float radiusB = colB.m_type == BoundingType::SPHERE ? colB.m_scale.x : 0.f;
 
-		else if (simplex.size() == 4) // tetrahedron
-			result = CheckTetrahedron(simplex, direction);
+	auto support = [&](const glm::vec3& direction)
+	{
+		//point of b - a furthest along -direction
+		CastVertex vertex;
+		vertex.m_pointB = core(colB, -direction);
+		vertex.m_point = vertex.m_pointB - core(colA, direction);
+		return vertex;
+	};
+
+	CastSimplex simplex;
+	glm::vec3 v;
+	if (cache && cache->m_count > 0)
+	{
+		//Points that were on the shapes still are, the rebuilt simplex is
+		//inside the difference and a valid start
+		for (int i = 0; i < cache->m_count; ++i)
+		{
+			CastVertex& vertex = simplex.m_vertices[i];
+			vertex.m_pointB = colB.m_position + colB.m_rotation * (colB.m_scale * cache->m_localB[i]);
+			vertex.m_point = vertex.m_pointB - (colA.m_position + colA.m_rotation * (colA.m_scale * cache->m_localA[i]));
+		}
+		simplex.m_count = cache->m_count;
+		v = ClosestOnSimplex(simplex, glm::vec3(0.f));
+	}
+	else
+	{
+		glm::vec3 direction = cache ? cache->m_direction : colB.m_position - colA.m_position;
+		if (glm::dot(direction, direction) < 1e-12f)
+			direction = glm::vec3(1.f, 0.f, 0.f);
 
+		simplex.Set(support(direction), 1.f);
+		v = simplex.m_vertices[0].m_point;
 	}
 
-	return result;
+	int iterations = 0;
+	while (simplex.m_count < 4 && iterations++ < GJK_EPA_MAX_ITER)
+	{
+		float vv = glm::dot(v, v);
+		if (vv < tolerance * tolerance)
+			break;
+
+		//no support point gets closer than the one found, v is the closest
+		CastVertex vertex = support(v);
+		if (vv - glm::dot(v, vertex.m_point) <= tolerance * std::sqrt(vv))
+			break;
+
+		//a tetrahedron left by ClosestOnSimplex holds the origin
+		CastSimplex previous = simplex;
+		simplex.m_vertices[simplex.m_count++] = vertex;
+		glm::vec3 closest = ClosestOnSimplex(simplex, glm::vec3(0.f));
+
+		//rounding on nearly flat simplices can stop the distance from
+		//shrinking, the last simplex is as close as it gets
+		if (simplex.m_count < 4 && glm::dot(closest, closest) >= vv)
+		{
+			simplex = previous;
+			break;
+		}
+		v = closest;
+	}
+
+	if (cache)
+	{
+		glm::quat toLocalA = glm::conjugate(colA.m_rotation);
+		glm::quat toLocalB = glm::conjugate(colB.m_rotation);
+		for (int i = 0; i < simplex.m_count; ++i)
+		{
+			const CastVertex& vertex = simplex.m_vertices[i];
+			cache->m_localA[i] = toLocalA * (vertex.m_pointB - vertex.m_point - colA.m_position) / colA.m_scale;
+			cache->m_localB[i] = toLocalB * (vertex.m_pointB - colB.m_position) / colB.m_scale;
+		}
+		cache->m_count = simplex.m_count;
+	}
+
+	float distance = glm::length(v);
+	if (simplex.m_count == 4 || distance < tolerance)
+	{
+		result.m_distance = 0.f;
+		return false;
+	}
+
+	glm::vec3 pointB(0.f), pointDifference(0.f);
+	for (int i = 0; i < simplex.m_count; ++i)
+	{
+		pointB += simplex.m_weights[i] * simplex.m_vertices[i].m_pointB;
+		pointDifference += simplex.m_weights[i] * simplex.m_vertices[i].m_point;
+	}
+
+	result.m_distance = distance - radiusA - radiusB;
+	result.m_normal = v / distance;
+	result.m_pointB = pointB - result.m_normal * radiusB;
+	result.m_pointA = pointB - pointDifference + result.m_normal * radiusA;
+
+	if (cache)
+		cache->m_direction = result.m_normal;
+	return true;
 }
 
 static std::pair<std::vector<glm::vec4>, size_t> GetFaceNormals(const std::vector<SupportVector>& polytope, const std::vector<size_t>& faces)
@@ -175,12 +322,13 @@ static void AddEdge(std::vector<std::pair<size_t, size_t>>& edges, const std::ve
 
 }
 
-static void EPA(const std::vector<SupportVector>& simplex, RigidBody* a, RigidBody* b, std::vector<ContactPoint>& colData)
+static void EPA(const GJKSimplex& simplex, RigidBody* a, RigidBody* b, std::vector<ContactPoint>& colData)
 {
 	auto colA = a->m_collider;
 	auto colB = b->m_collider;
 
-	std::vector<SupportVector> polytope(simplex.rbegin(), simplex.rend());
+	std::vector<SupportVector> polytope(simplex.m_points, simplex.m_points + simplex.m_count);
+	std::reverse(polytope.begin(), polytope.end());
 	std::vector<size_t> faces = { 0 ,1, 2,
 								  0, 3, 1,
 								  0, 2, 3,
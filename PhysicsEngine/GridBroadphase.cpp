@@ -0,0 +1,274 @@
+#include "GridBroadphase.h"
+#include <algorithm>
+
+GridBroadphase::GridBroadphase(Shape* box) : aabbBox(box)
+{
+}
+
+void GridBroadphase::AddProxy(RigidBody* body)
+{
+	int proxyId;
+	if (freeList == -1)
+	{
+		proxyId = (int)proxies.size();
+		proxies.emplace_back();
+	}
+	else
+	{
+		proxyId = freeList;
+		freeList = proxies[proxyId].m_next;
+	}
+
+	Proxy& proxy = proxies[proxyId];
+	proxy.m_box = body->m_collider->m_aabb;
+	proxy.m_clientData = body;
+	proxy.m_lowerCell = glm::ivec3(0);
+	proxy.m_upperCell = glm::ivec3(-1); // not in the grid until the next UpdatePairs
+	proxy.m_next = -1;
+	proxy.m_filter = body->m_filter;
+	proxy.m_static = !body->IsDynamic();
+	proxy.m_large = false;
+	proxy.m_colliding = false;
+
+	body->m_proxyId = proxyId;
+}
+
+void GridBroadphase::RemoveProxy(RigidBody* body)
+{
+	Proxy& proxy = proxies[body->m_proxyId];
+	proxy.m_clientData = nullptr;
+	proxy.m_next = freeList;
+	freeList = body->m_proxyId;
+	body->m_proxyId = -1;
+}
+
+void GridBroadphase::UpdatePairs()
+{
+	pairs.clear();
+	largeProxies.clear();
+	entries.clear();
+
+	//1 : Cell size from the median extent of the dynamic bodies
+	extents.clear();
+	for (const Proxy& proxy : proxies)
+	{
+		if (proxy.m_clientData == nullptr || proxy.m_static)
+			continue;
+
+		glm::vec3 e = proxy.m_clientData->m_collider->m_aabb.m_upper - proxy.m_clientData->m_collider->m_aabb.m_lower;
+		extents.push_back(std::max(e.x, std::max(e.y, e.z)));
+	}
+
+	if (!extents.empty())
+	{
+		std::nth_element(extents.begin(), extents.begin() + extents.size() / 2, extents.end());
+		cellSize = std::max(cellScale * extents[extents.size() / 2], 0.01f);
+		invCellSize = 1.0f / cellSize;
+	}
+
+	//2 : Find the cells of every proxy, the table gets about two buckets per entry
+	int entryCount = 0;
+	for (int i = 0; i < (int)proxies.size(); ++i)
+	{
+		Proxy& proxy = proxies[i];
+		if (proxy.m_clientData == nullptr)
+			continue;
+
+		proxy.m_box = proxy.m_clientData->m_collider->m_aabb;
+		proxy.m_filter = proxy.m_clientData->m_filter;
+		proxy.m_lowerCell = CellOf(proxy.m_box.m_lower);
+		proxy.m_upperCell = CellOf(proxy.m_box.m_upper);
+		proxy.m_large = CellCount(proxy.m_lowerCell, proxy.m_upperCell) > maxCellsPerProxy;
+
+		if (proxy.m_large)
+			largeProxies.push_back(i);
+		else
+			entryCount += (int)CellCount(proxy.m_lowerCell, proxy.m_upperCell);
+	}
+
+	bucketCount = 16;
+	while (bucketCount < 2 * entryCount)
+		bucketCount *= 2;
+
+	//3 : Counting sort of the (bucket, proxy) entries into the flat grid
+	cellStart.assign(bucketCount + 1, 0);
+	for (int i = 0; i < (int)proxies.size(); ++i)
+	{
+		const Proxy& proxy = proxies[i];
+		if (proxy.m_clientData == nullptr || proxy.m_large)
+			continue;
+
+		size_t first = entries.size();
+		for (int x = proxy.m_lowerCell.x; x <= proxy.m_upperCell.x; ++x)
+		{
+			for (int y = proxy.m_lowerCell.y; y <= proxy.m_upperCell.y; ++y)
+			{
+				for (int z = proxy.m_lowerCell.z; z <= proxy.m_upperCell.z; ++z)
+				{
+					//two cells of one proxy can share a bucket, keep it once
+					int bucket = BucketOf(glm::ivec3(x, y, z));
+					bool found = false;
+					for (size_t k = first; k < entries.size() && !found; ++k)
+						found = entries[k].first == bucket;
+
+					if (found)
+						continue;
+
+					entries.emplace_back(bucket, i);
+					++cellStart[bucket + 1];
+				}
+			}
+		}
+	}
+
+	for (int b = 0; b < bucketCount; ++b)
+		cellStart[b + 1] += cellStart[b];
+
+	cellProxies.resize(entries.size());
+	for (const auto& entry : entries)
+		cellProxies[cellStart[entry.first]++] = entry.second;
+
+	//the scatter moved every start to the next bucket, shift them back
+	for (int b = bucketCount; b > 0; --b)
+		cellStart[b] = cellStart[b - 1];
+	cellStart[0] = 0;
+
+	//4 : Pairs sharing a bucket. A pair touching several cells is only kept in
+	//the bucket of the cell holding the lower corner of the boxes' overlap
+	for (int b = 0; b < bucketCount; ++b)
+	{
+		for (int i = cellStart[b]; i < cellStart[b + 1]; ++i)
+		{
+			const Proxy& A = proxies[cellProxies[i]];
+			for (int j = i + 1; j < cellStart[b + 1]; ++j)
+			{
+				const Proxy& B = proxies[cellProxies[j]];
+				if ((A.m_static && B.m_static) || !A.m_filter.ShouldCollide(B.m_filter) || !A.m_box.Overlaps(B.m_box))
+					continue;
+
+				glm::vec3 corner = glm::max(A.m_box.m_lower, B.m_box.m_lower);
+				if (BucketOf(CellOf(corner)) == b)
+					AddPair(cellProxies[i], cellProxies[j]);
+			}
+		}
+	}
+
+	//5 : Large proxies against everything else
+	for (int large : largeProxies)
+	{
+		const Proxy& A = proxies[large];
+		for (int i = 0; i < (int)proxies.size(); ++i)
+		{
+			const Proxy& B = proxies[i];
+			if (B.m_clientData == nullptr || i == large || (B.m_large && i < large))
+				continue;
+
+			if ((A.m_static && B.m_static) || !A.m_filter.ShouldCollide(B.m_filter) || !A.m_box.Overlaps(B.m_box))
+				continue;
+
+			AddPair(large, i);
+		}
+	}
+}
+
+void GridBroadphase::AddPair(int proxyA, int proxyB)
+{
+	//dynamic body first
+	if (proxies[proxyA].m_static)
+		std::swap(proxyA, proxyB);
+
+	if (!AcceptPair(proxies[proxyA].m_clientData, proxies[proxyB].m_clientData))
+		return;
+	pairs.emplace_back(proxyA, proxyB);
+}
+
+void GridBroadphase::ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback)
+{
+	for (Proxy& proxy : proxies)
+		proxy.m_colliding = false;
+
+	for (const auto& p : pairs)
+	{
+		Proxy& A = proxies[p.first];
+		Proxy& B = proxies[p.second];
+		if (!callback(A.m_clientData, B.m_clientData))
+			continue;
+
+		A.m_colliding = true;
+		B.m_colliding = true;
+	}
+}
+
+void GridBroadphase::Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback)
+{
+	glm::ivec3 lower = CellOf(aabb.m_lower);
+	glm::ivec3 upper = CellOf(aabb.m_upper);
+
+	//A query wider than the grid has buckets is cheaper as a plain loop
+	if (bucketCount == 0 || CellCount(lower, upper) > bucketCount)
+	{
+		for (const Proxy& proxy : proxies)
+		{
+			if (proxy.m_clientData && proxy.m_box.Overlaps(aabb) && !callback(proxy.m_clientData))
+				return;
+		}
+		return;
+	}
+
+	for (int x = lower.x; x <= upper.x; ++x)
+	{
+		for (int y = lower.y; y <= upper.y; ++y)
+		{
+			for (int z = lower.z; z <= upper.z; ++z)
+			{
+				//A proxy is only reported from the first cell it shares with the
+				//query, like the pairs above. Nothing is marked, so a callback
+				//can start another query
+				glm::ivec3 cell(x, y, z);
+				int bucket = BucketOf(cell);
+				for (int i = cellStart[bucket]; i < cellStart[bucket + 1]; ++i)
+				{
+					const Proxy& proxy = proxies[cellProxies[i]];
+					if (proxy.m_clientData == nullptr || !proxy.m_box.Overlaps(aabb))
+						continue;
+
+					if (glm::max(proxy.m_lowerCell, lower) == cell && !callback(proxy.m_clientData))
+						return;
+				}
+			}
+		}
+	}
+
+	for (int large : largeProxies)
+	{
+		const Proxy& proxy = proxies[large];
+		if (proxy.m_clientData && proxy.m_box.Overlaps(aabb) && !callback(proxy.m_clientData))
+			return;
+	}
+}
+
+void GridBroadphase::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<float(RigidBody*, float)>& callback)
+{
+	glm::vec3 invDir = 1.0f / direction;
+
+	for (const Proxy& proxy : proxies)
+	{
+		float t;
+		if (proxy.m_clientData == nullptr || !proxy.m_box.RayIntersect(origin, invDir, maxT, t))
+			continue;
+
+		maxT = callback(proxy.m_clientData, t);
+		if (maxT <= 0.f)
+			return;
+	}
+}
+
+void GridBroadphase::Draw(int programId)
+{
+	for (const Proxy& proxy : proxies)
+	{
+		if (proxy.m_clientData)
+			proxy.m_box.Draw(programId, aabbBox, proxy.m_colliding);
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Broadphase.h"
+#include <cstdint>
+
+// Uniform spatial hash grid. Nothing is kept between steps : UpdatePairs
+// sizes the cells from the median extent of the dynamic bodies, buckets
+// every proxy into the cells it touches with a counting sort and tests the
+// bodies sharing a bucket. Meant for the stress test where most bodies have
+// the same size. Bodies spanning too many cells (the floor) are kept aside
+// and tested against everything
+class GridBroadphase : public Broadphase
+{
+public:
+	GridBroadphase(Shape* box);
+
+	void AddProxy(RigidBody* body) override;
+	void RemoveProxy(RigidBody* body) override;
+
+	/// @brief The grid is rebuilt from the colliders every step, nothing to do
+	void MoveProxy(RigidBody*) override {}
+	void RefilterProxy(RigidBody*) override {}
+	void UpdateProxy(RigidBody*, const glm::vec3&) override {}
+
+	/// @brief Rebuild the grid from the current AABBs and find the pairs
+	void UpdatePairs() override;
+	void ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback) override;
+
+	/// @brief Walks the cells of the grid built by the last UpdatePairs
+	void Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback) override;
+
+	/// @brief Tests every proxy
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(RigidBody*, float)>& callback) override;
+
+	void Draw(int programId) override;
+	const char* GetName() const override { return "Hash Grid"; }
+
+	float GetCellSize() const { return cellSize; }
+
+private:
+	struct Proxy
+	{
+		AABB m_box;
+		RigidBody* m_clientData; // nullptr while the proxy is on the free list
+		glm::ivec3 m_lowerCell;
+		glm::ivec3 m_upperCell;
+		int m_next;
+		CollisionFilter m_filter;
+		bool m_static;
+		bool m_large;
+		bool m_colliding;
+	};
+
+	/// @brief Cell holding p. Far away or infinite bounds are clamped to 2^19
+	/// cells per axis, the cast stays defined and a span product fits 64 bits
+	glm::ivec3 CellOf(const glm::vec3& p) const
+	{
+		const float limit = float(1 << 19);
+		return glm::ivec3(glm::clamp(glm::floor(p * invCellSize), -limit, limit));
+	}
+
+	int BucketOf(const glm::ivec3& cell) const
+	{
+		unsigned int h = (unsigned int)cell.x * 73856093u ^ (unsigned int)cell.y * 19349663u ^ (unsigned int)cell.z * 83492791u;
+		return (int)(h & (unsigned int)(bucketCount - 1));
+	}
+
+	//in 64 bits : the product overflows an int for a box a few thousand cells wide
+	static int64_t CellCount(const glm::ivec3& lower, const glm::ivec3& upper)
+	{
+		glm::ivec3 span = upper - lower + 1;
+		return (int64_t)span.x * span.y * span.z;
+	}
+
+	void AddPair(int proxyA, int proxyB);
+
+	std::vector<Proxy> proxies;
+	std::vector<std::pair<int, int>> pairs;
+	std::vector<int> largeProxies;
+
+	//Flat grid : the proxies of bucket b are cellProxies[cellStart[b], cellStart[b + 1])
+	std::vector<int> cellStart;
+	std::vector<int> cellProxies;
+	std::vector<std::pair<int, int>> entries; // (bucket, proxy) before the counting sort
+	std::vector<float> extents;
+
+	int bucketCount = 0;
+	int freeList = -1;
+	Shape* aabbBox;
+
+	float cellSize = 1.0f;
+	float cellScale = 2.0f; // cell size over the median extent
+	float invCellSize = 1.0f;
+	int maxCellsPerProxy = 27; // proxies touching more cells go to largeProxies
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+
+// Traversal stack living in the function that walks a tree. The first N
+// entries need no allocation, deeper trees spill to the heap. Every query
+// owns its stack, so a callback can start another query on the same tree
+// without cutting the outer traversal short
+template<typename T, int N = 256>
+class GrowableStack
+{
+public:
+	GrowableStack() : data(fixed), count(0), capacity(N) {}
+	GrowableStack(const GrowableStack&) = delete;
+	GrowableStack& operator=(const GrowableStack&) = delete;
+
+	~GrowableStack()
+	{
+		if (data != fixed)
+			delete[] data;
+	}
+
+	void Push(const T& value)
+	{
+		if (count == capacity)
+			Grow();
+		data[count++] = value;
+	}
+
+	T Pop() { return data[--count]; }
+
+	bool IsEmpty() const { return count == 0; }
+
+private:
+	void Grow()
+	{
+		T* larger = new T[capacity * 2];
+		std::copy(data, data + count, larger);
+		if (data != fixed)
+			delete[] data;
+
+		data = larger;
+		capacity *= 2;
+	}
+
+	T fixed[N];
+	T* data;
+	int count;
+	int capacity;
+};
@@ -104,8 +104,8 @@ static bool CreateEdgeContact(std::shared_ptr<ConvexCollider> colA, std::shared_
 {
 	glm::vec3 edgeAStart = colA->m_vertices[colA->m_edges[e1].first.first];
 	glm::vec3 edgeAEnd = colA->m_vertices[colA->m_edges[e1].first.second];
-	glm::vec3 edgeBStart = colA->m_vertices[colA->m_edges[e2].first.first];
-	glm::vec3 edgeBEnd = colA->m_vertices[colA->m_edges[e2].first.second];
+	glm::vec3 edgeBStart = colB->m_vertices[colB->m_edges[e2].first.first];
+	glm::vec3 edgeBEnd = colB->m_vertices[colB->m_edges[e2].first.second];
 	glm::vec3 contactPointA, contactPointB;
 
 	SegmentsClosestPoints(edgeAStart, edgeAEnd, edgeBStart, edgeBEnd, contactPointA, contactPointB);
@@ -0,0 +1,253 @@
+#include "LBVH.h"
+#include "BVH.h"
+#include <algorithm>
+#include <thread>
+
+//Spread the low 10 bits of v so there are two zero bits between each
+static unsigned int ExpandBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+//Count of leading zero bits, 32 for 0
+static int CountLeadingZeros(unsigned int v)
+{
+	int n = 0;
+	if (v == 0)
+		return 32;
+	while ((v & 0x80000000u) == 0)
+	{
+		v <<= 1;
+		++n;
+	}
+	return n;
+}
+
+int LinearBVH::Build(Node* nodes, int nodeCount, const int* leaves, const int* internalNodes, int leafCount)
+{
+	count = leafCount;
+	if (count == 1)
+		return leaves[0];
+
+	workers = threadCount > 0 ? threadCount : std::max((int)std::thread::hardware_concurrency(), 1);
+
+	//1 : Bounds of the box centers
+	threadBounds.resize(workers);
+	for (AABB& b : threadBounds)
+	{
+		b.m_lower = glm::vec3(FLT_MAX);
+		b.m_upper = glm::vec3(-FLT_MAX);
+	}
+
+	ParallelFor(count, [&](int thread, int begin, int end)
+		{
+			AABB& b = threadBounds[thread];
+			for (int i = begin; i < end; ++i)
+			{
+				const AABB& box = nodes[leaves[i]].m_box;
+				glm::vec3 c = (box.m_lower + box.m_upper) * 0.5f;
+				b.m_lower = glm::min(b.m_lower, c);
+				b.m_upper = glm::max(b.m_upper, c);
+			}
+		});
+
+	AABB centers = threadBounds[0];
+	for (int t = 1; t < workers; ++t)
+	{
+		centers.m_lower = glm::min(centers.m_lower, threadBounds[t].m_lower);
+		centers.m_upper = glm::max(centers.m_upper, threadBounds[t].m_upper);
+	}
+
+	//2 : 30 bit Morton code of each center on a 1024^3 grid
+	glm::vec3 size = centers.m_upper - centers.m_lower;
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; ++axis)
+		scale[axis] = size[axis] > 0.f ? 1023.f / size[axis] : 0.f;
+
+	keys.resize(count);
+	ParallelFor(count, [&](int, int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				const AABB& box = nodes[leaves[i]].m_box;
+				glm::vec3 c = glm::clamp(((box.m_lower + box.m_upper) * 0.5f - centers.m_lower) * scale, glm::vec3(0.f), glm::vec3(1023.f));
+				unsigned int code = ExpandBits((unsigned int)c.x) << 2 | ExpandBits((unsigned int)c.y) << 1 | ExpandBits((unsigned int)c.z);
+				keys[i] = (unsigned long long)code << 32 | (unsigned int)i;
+			}
+		});
+
+	//3 : Sort by code, the slot in the low bits makes every key unique
+	SortKeys();
+
+	sortedLeaves.resize(count);
+	ParallelFor(count, [&](int, int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+				sortedLeaves[i] = leaves[keys[i] & 0xFFFFFFFFu];
+		});
+
+	//4 : Every internal node finds its range and split independently
+	ParallelFor(count - 1, [&](int, int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+				EmitNode(nodes, internalNodes, i);
+		});
+
+	//5 : Refit from the leaves up. The second child to reach a node refits it
+	//and keeps climbing, so each node is refit once both children are done
+	if (visitCapacity < nodeCount)
+	{
+		visitCapacity = nodeCount;
+		visits.reset(new std::atomic<int>[visitCapacity]);
+	}
+	for (int i = 0; i < count - 1; ++i)
+		visits[internalNodes[i]].store(0, std::memory_order_relaxed);
+
+	ParallelFor(count, [&](int, int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				int index = nodes[sortedLeaves[i]].m_parent;
+				while (index != NULL_NODE)
+				{
+					if (visits[index].fetch_add(1, std::memory_order_acq_rel) == 0)
+						break;
+
+					Node& node = nodes[index];
+					const Node& left = nodes[node.m_left];
+					const Node& right = nodes[node.m_right];
+					node.m_box.m_lower = glm::min(left.m_box.m_lower, right.m_box.m_lower);
+					node.m_box.m_upper = glm::max(left.m_box.m_upper, right.m_box.m_upper);
+					node.m_hieght = std::max(left.m_hieght, right.m_hieght) + 1;
+					index = node.m_parent;
+				}
+			}
+		});
+
+	return internalNodes[0];
+}
+
+void LinearBVH::EmitNode(Node* nodes, const int* internalNodes, int i)
+{
+	//Direction of the range from the neighbour sharing the longer prefix
+	int d = Delta(i, i + 1) - Delta(i, i - 1) >= 0 ? 1 : -1;
+
+	//Upper bound of the range length, then binary search for the other end
+	int deltaMin = Delta(i, i - d);
+	int lengthMax = 2;
+	while (Delta(i, i + lengthMax * d) > deltaMin)
+		lengthMax *= 2;
+
+	int length = 0;
+	for (int t = lengthMax / 2; t >= 1; t /= 2)
+	{
+		if (Delta(i, i + (length + t) * d) > deltaMin)
+			length += t;
+	}
+	int j = i + length * d;
+
+	//Split : last leaf sharing more than the whole range's prefix with i
+	int deltaNode = Delta(i, j);
+	int split = 0;
+	for (int div = 2, t = (length + 1) / 2; ; div *= 2, t = (length + div - 1) / div)
+	{
+		if (Delta(i, i + (split + t) * d) > deltaNode)
+			split += t;
+		if (t <= 1)
+			break;
+	}
+	int gamma = i + split * d + std::min(d, 0);
+
+	int first = std::min(i, j);
+	int last = std::max(i, j);
+	int left = first == gamma ? sortedLeaves[gamma] : internalNodes[gamma];
+	int right = last == gamma + 1 ? sortedLeaves[gamma + 1] : internalNodes[gamma + 1];
+
+	Node& node = nodes[internalNodes[i]];
+	node.m_left = left;
+	node.m_right = right;
+	node.m_clientData = nullptr;
+	nodes[left].m_parent = internalNodes[i];
+	nodes[right].m_parent = internalNodes[i];
+
+	if (i == 0)
+		node.m_parent = NULL_NODE;
+}
+
+int LinearBVH::Delta(int i, int j) const
+{
+	if (j < 0 || j >= count)
+		return -1;
+
+	unsigned int a = (unsigned int)(keys[i] >> 32);
+	unsigned int b = (unsigned int)(keys[j] >> 32);
+	if (a == b)
+		return 32 + CountLeadingZeros((unsigned int)i ^ (unsigned int)j);
+
+	return CountLeadingZeros(a ^ b);
+}
+
+void LinearBVH::SortKeys()
+{
+	//LSD radix sort of the 32 code bits, 8 bits per pass. Each thread counts
+	//the digits of its chunk, the prefix sum gives every (digit, thread) its
+	//output range, then the chunks are scattered in parallel and stay stable
+	sortBuffer.resize(count);
+	histograms.resize(256 * workers);
+
+	for (int shift = 32; shift < 64; shift += 8)
+	{
+		std::fill(histograms.begin(), histograms.end(), 0);
+
+		ParallelFor(count, [&](int thread, int begin, int end)
+			{
+				int* histogram = &histograms[256 * thread];
+				for (int i = begin; i < end; ++i)
+					++histogram[(keys[i] >> shift) & 0xFF];
+			});
+
+		int offset = 0;
+		for (int digit = 0; digit < 256; ++digit)
+		{
+			for (int t = 0; t < workers; ++t)
+			{
+				int digitCount = histograms[256 * t + digit];
+				histograms[256 * t + digit] = offset;
+				offset += digitCount;
+			}
+		}
+
+		ParallelFor(count, [&](int thread, int begin, int end)
+			{
+				int* histogram = &histograms[256 * thread];
+				for (int i = begin; i < end; ++i)
+					sortBuffer[histogram[(keys[i] >> shift) & 0xFF]++] = keys[i];
+			});
+
+		keys.swap(sortBuffer);
+	}
+}
+
+void LinearBVH::ParallelFor(int itemCount, const std::function<void(int, int, int)>& body)
+{
+	//Chunks are fixed per thread index so the radix passes see the same split
+	const int minPerThread = 4096;
+	int chunk = (itemCount + workers - 1) / workers;
+
+	if (workers == 1 || !pool || itemCount < minPerThread * 2)
+	{
+		//one chunk per thread index anyway, the radix sort relies on it
+		for (int t = 0; t < workers; ++t)
+			body(t, std::min(t * chunk, itemCount), std::min((t + 1) * chunk, itemCount));
+		return;
+	}
+
+	pool->Run(workers, [&](int t)
+		{
+			body(t, std::min(t * chunk, itemCount), std::min((t + 1) * chunk, itemCount));
+		});
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Collider.h"
+#include "WorkerPool.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+
+struct Node;
+
+// Linear BVH builder (Karras 2012). Leaves are sorted along a Morton curve
+// of their box centers, then every internal node finds the range of leaves
+// it covers on its own, so all stages run in parallel : Morton codes, radix
+// sort, hierarchy emission and the bottom-up refit. The hierarchy is
+// written into AABBDynamicTree nodes. Much faster than the binned SAH build,
+// with a somewhat worse tree
+class LinearBVH
+{
+public:
+	/// @brief Link the leaves under the given internal nodes
+	/// @param nodeCount - Size of the node pool
+	/// @param leaves - Indices of the leaf nodes, count of them
+	/// @param internalNodes - count - 1 allocated nodes to use as internal nodes
+	/// @return Index of the root
+	int Build(Node* nodes, int nodeCount, const int* leaves, const int* internalNodes, int count);
+
+	int threadCount = 0; // 0 : one per hardware thread
+	WorkerPool* pool = nullptr; // runs the chunks, without one the build is serial
+
+private:
+	/// @brief Split [0, count) in one chunk per thread, small ranges run on the caller
+	void ParallelFor(int count, const std::function<void(int, int, int)>& body);
+
+	/// @brief Common prefix length of the keys of sorted leaves i and j, -1 out of range
+	int Delta(int i, int j) const;
+
+	void SortKeys();
+	void EmitNode(Node* nodes, const int* internalNodes, int index);
+
+	int count = 0;
+	int workers = 1;
+
+	std::vector<unsigned long long> keys; // Morton code << 32 | leaf slot
+	std::vector<unsigned long long> sortBuffer;
+	std::vector<int> sortedLeaves;
+	std::vector<AABB> threadBounds;
+	std::vector<int> histograms; // 256 digits per thread
+
+	std::unique_ptr<std::atomic<int>[]> visits; // children refit so far, by node index
+	int visitCapacity = 0;
+};
@@ -1,17 +1,64 @@
 #include <thread>
 #include <iostream>
+#include <chrono>
 #include "Physics.h"
+#include "TreeBroadphase.h"
+#include "SAPBroadphase.h"
+#include "GridBroadphase.h"
 
 Physics::Physics()
 {
 	m_DynamicPhysicsObjects.clear();
 	m_StaticPhysicsObjects.clear();
-	tree = new AABBDynamicTree(new Box());
+	aabbBox = new Box();
+	broadphase = new TreeBroadphase(aabbBox);
+
+	//Every pair of collider types, the other order is served swapped
+	m_dispatcher.Register(BoundingType::SPHERE, BoundingType::SPHERE, intersectSphereSphere);
+	m_dispatcher.Register(BoundingType::BOX, BoundingType::SPHERE, intersectBoxSphere);
+	m_dispatcher.Register(BoundingType::CONVEX, BoundingType::SPHERE, intersectConvexSphere);
+	m_dispatcher.Register(BoundingType::BOX, BoundingType::BOX, intersectOBBOBB);
+	//ConvexCollider is always built as a box, see intersectOBBOBB
+	m_dispatcher.Register(BoundingType::BOX, BoundingType::CONVEX, intersectOBBOBB);
+	m_dispatcher.Register(BoundingType::CONVEX, BoundingType::CONVEX, intersectWithConvex);
+}
+
+void Physics::SetBroadphase(BroadphaseType type)
+{
+	if (type == m_broadphaseType)
+		return;
+
+	Broadphase* newBroadphase = nullptr;
+	switch (type)
+	{
+	case BroadphaseType::TREE:
+		newBroadphase = new TreeBroadphase(aabbBox);
+		break;
+	case BroadphaseType::SAP:
+		newBroadphase = new SAPBroadphase(aabbBox);
+		break;
+	case BroadphaseType::GRID:
+		newBroadphase = new GridBroadphase(aabbBox);
+		break;
+	default:
+		return;
+	}
+
+	//Proxy ids of the old backend mean nothing to the new one
+	newBroadphase->SetPairFilter(m_pairFilter);
+	for (auto obj : m_DynamicPhysicsObjects)
+		newBroadphase->AddProxy(&obj->rigidbody);
+	for (auto obj : m_StaticPhysicsObjects)
+		newBroadphase->AddProxy(&obj->rigidbody);
+
+	delete broadphase;
+	broadphase = newBroadphase;
+	m_broadphaseType = type;
 }
 
 void Physics::Init()
 {
-	m_CollisionQueue.clear();
+	m_pairCache.Clear();
 	
 }
 
@@ -30,14 +77,218 @@ void Physics::AddPhysicsObject(Object* obj)
 	if (obj == nullptr)
 		return;
 
+	UpdateCollider(obj->rigidbody);
+
 	if (obj->rigidbody.IsDynamic())
 		m_DynamicPhysicsObjects.emplace_back(obj);
-	else if (!obj->rigidbody.IsDynamic())
-		m_StaticPhysicsObjects.emplace_back(obj);
 	else
+		m_StaticPhysicsObjects.emplace_back(obj);
+
+	broadphase->AddProxy(&obj->rigidbody);
+}
+
+void Physics::AddPhysicsObjects(const std::vector<Object*>& objs)
+{
+	std::vector<RigidBody*> bodies;
+	bodies.reserve(objs.size());
+
+	for (Object* obj : objs)
+	{
+		if (obj == nullptr)
+			continue;
+
+		UpdateCollider(obj->rigidbody);
+
+		if (obj->rigidbody.IsDynamic())
+			m_DynamicPhysicsObjects.emplace_back(obj);
+		else
+			m_StaticPhysicsObjects.emplace_back(obj);
+
+		bodies.push_back(&obj->rigidbody);
+	}
+
+	broadphase->AddProxies(bodies);
+}
+
+void Physics::MovePhysicsObject(Object* obj)
+{
+	if (obj == nullptr || obj->rigidbody.m_proxyId == -1)
+		return;
+
+	UpdateCollider(obj->rigidbody);
+	broadphase->MoveProxy(&obj->rigidbody);
+}
+
+void Physics::SetCollisionFilter(Object* obj, const CollisionFilter& filter)
+{
+	if (obj == nullptr)
 		return;
 
-	tree->Insert(&obj->rigidbody);
+	obj->rigidbody.m_filter = filter;
+	if (obj->rigidbody.m_proxyId != -1)
+		broadphase->RefilterProxy(&obj->rigidbody);
+}
+
+void Physics::SetPairFilter(const std::function<bool(RigidBody*, RigidBody*)>& filter)
+{
+	m_pairFilter = filter;
+	broadphase->SetPairFilter(filter);
+}
+
+void Physics::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<bool(RigidBody*)>& filter, const std::function<float(const RayHit&)>& callback)
+{
+	broadphase->RayCast(origin, direction, maxT, [&](RigidBody* body, float)
+		{
+			RayHit hit;
+			if ((filter && !filter(body)) || !RayCastBody(body, origin, direction, maxT, hit))
+				return maxT;
+
+			maxT = callback(hit);
+			return maxT;
+		});
+}
+
+bool Physics::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT, RayHit& hit,
+	RayCastMode mode, const std::function<bool(RigidBody*)>& filter)
+{
+	bool found = false;
+	RayCast(origin, direction, maxT, filter, [&](const RayHit& candidate)
+		{
+			//the broadphase only reports bodies closer than the returned maxT
+			hit = candidate;
+			found = true;
+			return mode == RayCastMode::ANY ? 0.f : candidate.m_t;
+		});
+	return found;
+}
+
+int Physics::RayCastPacket(RayPacket& packet, RayHit* hits, RayCastMode mode, const std::function<bool(RigidBody*)>& filter)
+{
+	int hitMask = 0;
+	broadphase->RayCastPacket(packet, [&](int ray, RigidBody* body, float)
+		{
+			float maxT = packet.m_maxT[ray];
+			RayHit hit;
+			if ((filter && !filter(body)) || !RayCastBody(body, packet.m_origin[ray], packet.m_direction[ray], maxT, hit))
+				return maxT;
+
+			hits[ray] = hit;
+			hitMask |= 1 << ray;
+			return mode == RayCastMode::ANY ? 0.f : hit.m_t;
+		});
+	return hitMask;
+}
+
+bool Physics::ShapeCast(const Collider& shape, const glm::vec3& from, const glm::vec3& to, ShapeHit& hit,
+	const std::function<bool(RigidBody*)>& filter)
+{
+	AABB start, end;
+	start.Update(from, shape.m_scale, shape.m_rotation);
+	end.Update(to, shape.m_scale, shape.m_rotation);
+
+	AABB swept;
+	swept.m_lower = glm::min(start.m_lower, end.m_lower);
+	swept.m_upper = glm::max(start.m_upper, end.m_upper);
+
+	//candidates come in no particular order, each cast stops at the best hit so far
+	glm::vec3 translation = to - from;
+	float maxT = 1.f;
+	bool found = false;
+	broadphase->Query(swept, [&](RigidBody* body)
+		{
+			ShapeHit candidate;
+			if (!body->m_collider->m_aabb.Overlaps(swept) || (filter && !filter(body)) ||
+				!ShapeCastBody(shape, from, translation, body, maxT, candidate))
+				return true;
+
+			hit = candidate;
+			maxT = candidate.m_t;
+			found = true;
+			return maxT > 0.f;
+		});
+	return found;
+}
+
+void Physics::QueryAABB(const AABB& aabb, const std::function<bool(RigidBody*)>& filter,
+	const std::function<bool(RigidBody*)>& callback)
+{
+	//the broadphase reports fat boxes, keep the bodies that really overlap
+	broadphase->Query(aabb, [&](RigidBody* body)
+		{
+			if (!body->m_collider->m_aabb.Overlaps(aabb) || (filter && !filter(body)))
+				return true;
+			return callback(body);
+		});
+}
+
+void Physics::QuerySphere(const glm::vec3& center, float radius, const std::function<bool(RigidBody*)>& filter,
+	const std::function<bool(RigidBody*)>& callback)
+{
+	broadphase->QuerySphere(center, radius, [&](RigidBody* body)
+		{
+			if (!body->m_collider->m_aabb.OverlapsSphere(center, radius) || (filter && !filter(body)))
+				return true;
+			return callback(body);
+		});
+}
+
+void Physics::QueryFrustum(const Frustum& frustum, const std::function<bool(RigidBody*)>& filter,
+	const std::function<bool(RigidBody*)>& callback)
+{
+	AABB bounds = frustum.Bounds();
+	broadphase->QueryFrustum(frustum, [&](RigidBody* body)
+		{
+			const AABB& box = body->m_collider->m_aabb;
+			int planeMask = (1 << 6) - 1;
+			if (!box.Overlaps(bounds) || frustum.Classify(box, planeMask) == FrustumTest::OUTSIDE || (filter && !filter(body)))
+				return true;
+			return callback(body);
+		});
+}
+
+int Physics::QueryAABB(const AABB& aabb, RigidBody** results, int capacity, const std::function<bool(RigidBody*)>& filter)
+{
+	int count = 0;
+	if (capacity > 0)
+	{
+		QueryAABB(aabb, filter, [&](RigidBody* body)
+			{
+				results[count++] = body;
+				return count < capacity;
+			});
+	}
+	return count;
+}
+
+int Physics::QuerySphere(const glm::vec3& center, float radius, RigidBody** results, int capacity,
+	const std::function<bool(RigidBody*)>& filter)
+{
+	int count = 0;
+	if (capacity > 0)
+	{
+		QuerySphere(center, radius, filter, [&](RigidBody* body)
+			{
+				results[count++] = body;
+				return count < capacity;
+			});
+	}
+	return count;
+}
+
+int Physics::QueryFrustum(const Frustum& frustum, RigidBody** results, int capacity,
+	const std::function<bool(RigidBody*)>& filter)
+{
+	int count = 0;
+	if (capacity > 0)
+	{
+		QueryFrustum(frustum, filter, [&](RigidBody* body)
+			{
+				results[count++] = body;
+				return count < capacity;
+			});
+	}
+	return count;
 }
 
 void Physics::RemovePhysicsObject(Object* obj)
@@ -59,14 +310,14 @@ void Physics::RemovePhysicsObject(Object* obj)
 	else
 		m_DynamicPhysicsObjects.erase(it);
 
-	int leafIndex = tree->FindIndex(&obj->rigidbody);
-	tree->Remove(leafIndex);
+	broadphase->RemoveProxy(&obj->rigidbody);
 }
 
 void Physics::RemoveAllDynamicObjects()
 {
-	for (int i = m_DynamicPhysicsObjects.size() -1 ; i >= 0; --i)
-		RemovePhysicsObject(m_DynamicPhysicsObjects[i]);
+	for (auto obj : m_DynamicPhysicsObjects)
+		broadphase->RemoveProxy(&obj->rigidbody);
+	m_DynamicPhysicsObjects.clear();
 }
 
 std::vector<Object*>& Physics::GetDynamicPhysicsObjects()
@@ -79,76 +330,10 @@ std::vector<Object*>& Physics::GetStaticPhysicsObjects()
 	return m_StaticPhysicsObjects;
 }
 
-void Physics::DetectCollisionThread(int parent)
-{
-	std::vector<int> dynamicObjs;
-	std::vector<int> staticObjs;
-
-	std::queue<int> q;
-	if (parent != -1)
-		q.push(parent);
-
-	while (!q.empty())
-	{
-		int curr = q.front();
-		q.pop();
-
-		if (tree->nodes[curr]->m_left != -1)
-			q.push(tree->nodes[curr]->m_left);
-		if (tree->nodes[curr]->m_right != -1)
-			q.push(tree->nodes[curr]->m_right);
-
-		if (tree->nodes[curr]->IsLeaf())
-		{
-			if (tree->nodes[curr]->m_clientData->IsDynamic())
-				dynamicObjs.emplace_back(curr);
-			else
-				staticObjs.emplace_back(curr);
-		}
-	}
-
-	for (unsigned int i = 0; i < dynamicObjs.size(); ++i)
-	{
-		for (unsigned int j = i+1; j < dynamicObjs.size(); ++j)
-		{
-			if (i == j) continue;
-
-			if (!intersectAABB(tree->nodes[dynamicObjs[i]]->m_box, tree->nodes[dynamicObjs[j]]->m_box))
-				continue;
-
-			RigidBody* rbA = tree->nodes[dynamicObjs[i]]->m_clientData;
-			RigidBody* rbB = tree->nodes[dynamicObjs[j]]->m_clientData;
-			if (!Colliding(rbA, rbB))
-				continue;
-
-			tree->nodes[dynamicObjs[i]]->m_box.isColliding = true;
-			tree->nodes[dynamicObjs[j]]->m_box.isColliding = true;
-			rbA->m_collider->m_color = glm::vec3(1, 0, 0);
-			rbB->m_collider->m_color = glm::vec3(1, 0, 0);
-		}
-
-		for (unsigned int j = 0; j < staticObjs.size(); ++j)
-		{
-			if (!intersectAABB(tree->nodes[dynamicObjs[i]]->m_box, tree->nodes[staticObjs[j]]->m_box))
-				continue;
-
-			RigidBody* rbA = tree->nodes[dynamicObjs[i]]->m_clientData;
-			RigidBody* rbB = tree->nodes[staticObjs[j]]->m_clientData;
-			if (!Colliding(rbA, rbB))
-				continue;
-
-			tree->nodes[dynamicObjs[i]]->m_box.isColliding = true;
-			tree->nodes[staticObjs[j]]->m_box.isColliding = true;
-			rbA->m_collider->m_color = glm::vec3(1, 0, 0);
-			rbB->m_collider->m_color = glm::vec3(1, 0, 0);
-		}
-	}
-}
-
 bool Physics::Colliding(RigidBody* rbA, RigidBody* rbB)
 {
 	ContactPoint col;
-	if (intersect(rbA, rbB, col, m_CollisionQueue))
+	if (m_dispatcher.Intersect(rbA, rbB, col, m_pairCache))
 		return true;
 
 	return false;
@@ -156,41 +341,38 @@ bool Physics::Colliding(RigidBody* rbA, RigidBody* rbB)
 
 void Physics::DetectCollisions(float dt)
 {
-	//tree traversal
-	std::queue<int> q;
-	if (tree->rootIndex != -1)
-		q.push(tree->rootIndex);
+	//every step is a new frame of the pair cache, with contacts or not
+	m_pairCache.NewFrame();
 
-	while (!q.empty())
-	{
-		int curr = q.front();
-		q.pop();
+	auto start = std::chrono::high_resolution_clock::now();
 
-		int left = tree->nodes[curr]->m_left;
-		int right = tree->nodes[curr]->m_right;
+	for (auto obj : m_DynamicPhysicsObjects)
+	{
+		RigidBody& rb = obj->rigidbody;
+		broadphase->UpdateProxy(&rb, dt * rb.Velocity());
+	}
+	broadphase->UpdatePairs();
 
-		if (left == -1 || right == -1)
-			continue;
+	auto end = std::chrono::high_resolution_clock::now();
+	m_broadphaseTime = std::chrono::duration<float, std::milli>(end - start).count();
 
-		if (intersectAABB(tree->nodes[left]->m_box, tree->nodes[right]->m_box))
+	broadphase->ForEachPair([this](RigidBody* rbA, RigidBody* rbB)
 		{
-			DetectCollisionThread(curr);
-			tree->nodes[curr]->m_box.isColliding = true;
-		}
-		else
-		{
-			tree->nodes[curr]->m_box.isColliding = false;
-			q.push(left);
-			q.push(right);
-		}
-	}
+			if (!Colliding(rbA, rbB))
+				return false;
+
+			rbA->m_collider->m_color = glm::vec3(1, 0, 0);
+			rbB->m_collider->m_color = glm::vec3(1, 0, 0);
+			return true;
+		});
 }
 
 void Physics::InitializeConstraints()
 {
-	for (size_t i = 0; i < m_CollisionQueue.size(); ++i)
+	auto& collisionQueue = m_pairCache.GetManifolds();
+	for (size_t i = 0; i < collisionQueue.size(); ++i)
 	{
-		auto curr = m_CollisionQueue[i];
+		auto curr = collisionQueue[i];
 		auto colA = curr->a->m_collider;
 		auto colB = curr->b->m_collider;
 
@@ -235,9 +417,10 @@ void Physics::InitializeConstraints()
 
 void Physics::WarmStart()
 {
-	for (size_t i = 0; i < m_CollisionQueue.size(); ++i)
+	auto& collisionQueue = m_pairCache.GetManifolds();
+	for (size_t i = 0; i < collisionQueue.size(); ++i)
 	{
-		auto curr = m_CollisionQueue[i];
+		auto curr = collisionQueue[i];
 
 		glm::vec3& vA = curr->a->Velocity();
 		glm::vec3& vB = curr->b->Velocity();
@@ -270,16 +453,17 @@ void Physics::WarmStart()
 
 void Physics::SolveCollisions(float dt)
 {
-	if(!m_CollisionQueue.empty())
+	auto& collisionQueue = m_pairCache.GetManifolds();
+	if(!collisionQueue.empty())
 	{
 		InitializeConstraints();
 		WarmStart();
 
 		for (int j = 0; j < m_velocitySolveIt; ++j)
 		{
-			for (int i = 0; i < m_CollisionQueue.size(); ++i)
+			for (int i = 0; i < collisionQueue.size(); ++i)
 			{
-				auto col = m_CollisionQueue[i];
+				auto col = collisionQueue[i];
 				if (col->collided)
 					SolveVelocityConstraint(col, dt);
 
@@ -287,9 +471,9 @@ void Physics::SolveCollisions(float dt)
 		}
 
 		//Integrate the position
-		for (int j = 0; j < m_CollisionQueue.size(); ++j)
+		for (int j = 0; j < collisionQueue.size(); ++j)
 		{
-			auto col = m_CollisionQueue[j];
+			auto col = collisionQueue[j];
 			glm::quat newRotA, newRotB;
 			if (col->a->IsDynamic())
 				col->a->Rotate(dt);
@@ -301,8 +485,6 @@ void Physics::SolveCollisions(float dt)
 			col->a->m_collider->UpdateMatrix();
 			col->b->m_collider->UpdateMatrix();
 		}
-
-		m_CollisionQueue.clear();
 	}
 
 }
@@ -337,30 +519,21 @@ void Physics::Integrate(float dt)
 		rb.SetNetTorque({ 0.0f,0.0f,0.0f });
 
 		rb.m_collider->UpdateMatrix();
-
-		if (rb.m_collider->m_type == BoundingType::BOX)
-			std::static_pointer_cast<OBBCollider>(rb.m_collider)->OBBUpdate();
-		else if (rb.m_collider->m_type == BoundingType::CONVEX)
-			std::static_pointer_cast<ConvexCollider>(rb.m_collider)->ConvexUpdate();
-		else if (rb.m_collider->m_type == BoundingType::SPHERE)
-			std::static_pointer_cast<SphereCollider>(rb.m_collider)->SphereUpdate();
-		rb.m_collider->UpdateAABB();
-	}
-
-	for (auto obj : m_StaticPhysicsObjects)
-	{
-		RigidBody& rb = obj->rigidbody;
-		if (rb.m_collider->m_type == BoundingType::BOX)
-			std::static_pointer_cast<OBBCollider>(rb.m_collider)->OBBUpdate();
-		else if (rb.m_collider->m_type == BoundingType::CONVEX)
-			std::static_pointer_cast<ConvexCollider>(rb.m_collider)->ConvexUpdate();
-		else if (rb.m_collider->m_type == BoundingType::SPHERE)
-			std::static_pointer_cast<SphereCollider>(rb.m_collider)->SphereUpdate();
-		rb.m_collider->UpdateAABB();
+		UpdateCollider(rb);
 	}
 
-	tree->Update();
+	// Static objects are left alone here, see MovePhysicsObject
+}
 
+void Physics::UpdateCollider(RigidBody& rb)
+{
+	if (rb.m_collider->m_type == BoundingType::BOX)
+		std::static_pointer_cast<OBBCollider>(rb.m_collider)->OBBUpdate();
+	else if (rb.m_collider->m_type == BoundingType::CONVEX)
+		std::static_pointer_cast<ConvexCollider>(rb.m_collider)->ConvexUpdate();
+	else if (rb.m_collider->m_type == BoundingType::SPHERE)
+		std::static_pointer_cast<SphereCollider>(rb.m_collider)->SphereUpdate();
+	rb.m_collider->UpdateAABB();
 }
 
 void Physics::SolveVelocityConstraint(std::shared_ptr<CollisionData> col, float dt)
@@ -427,22 +600,18 @@ void Physics::ClearVectors()
 
 void Physics::ClearCollisionQueue()
 {
-	std::swap(m_CollisionQueue, std::vector<std::shared_ptr<CollisionData>>());
+	m_pairCache.Clear();
 }
 
 void Physics::RemoveStressObjects()
 {
-	for (int i = m_DynamicPhysicsObjects.size() - 1; i >= 0; --i)
-	{
-		if (m_DynamicPhysicsObjects[i]->name == "stressObject")
+	auto it = std::remove_if(m_DynamicPhysicsObjects.begin(), m_DynamicPhysicsObjects.end(), [this](Object* obj)
 		{
-			int index = tree->FindIndex(&m_DynamicPhysicsObjects[i]->rigidbody);
-			tree->Remove(index);
-
-			m_DynamicPhysicsObjects.erase(m_DynamicPhysicsObjects.begin() + i);
-		}
-	}
-
-	g_Physics->tree->Update();
+			if (obj->name != "stressObject")
+				return false;
 
+			broadphase->RemoveProxy(&obj->rigidbody);
+			return true;
+		});
+	m_DynamicPhysicsObjects.erase(it, m_DynamicPhysicsObjects.end());
 }
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "CollisionDetection.h"
-#include "BVH.h"
+#include "Broadphase.h"
+#include "RayCast.h"
+#include "ShapeCast.h"
 
 
 class Physics
@@ -27,6 +29,94 @@ public:
 	void AddPhysicsObject(Object* obj);
 
 
+	/// @brief Add many game objects at once, the broadphase inserts them as
+	/// a batch (scene loads, spawning a stress test)
+	/// @param objs - Physics Game Objects
+	void AddPhysicsObjects(const std::vector<Object*>& objs);
+
+
+	/// @brief Refresh the collider and broadphase proxy of an object that was
+	/// moved by hand. Static objects are only updated through this
+	/// @param obj - Physics Game Object
+	void MovePhysicsObject(Object* obj);
+
+
+	/// @brief Change which bodies an object collides with. Bodies not added
+	/// yet can set rigidbody.m_filter directly
+	/// @param obj - Physics Game Object
+	void SetCollisionFilter(Object* obj, const CollisionFilter& filter);
+
+
+	/// @brief Test run by the broadphase on every pair that passed the
+	/// collision filters, before the narrowphase. Return false to drop the
+	/// pair. May run on several threads at once, may be empty
+	void SetPairFilter(const std::function<bool(RigidBody*, RigidBody*)>& filter);
+
+
+	/// @brief Cast the ray origin + t * direction, t in [0, maxT], against the
+	/// colliders. The broadphase finds the candidates, each is tested exactly.
+	/// Candidates come from the proxies of the last DetectCollisions, a body
+	/// pushed further by the contact solve is found again next step
+	/// @param filter - Return false to ignore a body, may be empty
+	/// @param callback - Called for each hit. Returns the new maxT, hit.m_t to
+	/// keep only closer hits, 0 to stop
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<bool(RigidBody*)>& filter, const std::function<float(const RayHit&)>& callback);
+
+
+	/// @brief Cast a ray and keep the closest hit, or stop at any hit
+	/// @return True if something was hit
+	bool RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT, RayHit& hit,
+		RayCastMode mode = RayCastMode::CLOSEST, const std::function<bool(RigidBody*)>& filter = nullptr);
+
+
+	/// @brief RayCast for a packet of up to 8 rays traversing the broadphase together
+	/// @param hits - Hit of each lane of the packet
+	/// @return Bit i set if ray i hit something
+	int RayCastPacket(RayPacket& packet, RayHit* hits,
+		RayCastMode mode = RayCastMode::CLOSEST, const std::function<bool(RigidBody*)>& filter = nullptr);
+
+
+	/// @brief Sweep a collider from one position to another and find the first
+	/// body it touches. The broadphase is searched with the swept AABB and each
+	/// candidate is cast against with GJK. Casting a body's own collider also
+	/// finds that body at t = 0, filter it out
+	/// @param shape - Sphere, box or convex collider, only its type, rotation
+	/// and scale are used
+	/// @param filter - Return false to ignore a body, may be empty
+	/// @return True if something was hit, the shape is then at from + hit.m_t * (to - from)
+	bool ShapeCast(const Collider& shape, const glm::vec3& from, const glm::vec3& to, ShapeHit& hit,
+		const std::function<bool(RigidBody*)>& filter = nullptr);
+
+
+	/// @brief Report the bodies whose collider AABB overlaps aabb. Nothing is
+	/// allocated : the broadphase walks its trees with stacks local to the
+	/// query, so a callback may run another query
+	/// @param filter - Return false to ignore a body, may be empty
+	/// @param callback - Return false to stop
+	void QueryAABB(const AABB& aabb, const std::function<bool(RigidBody*)>& filter,
+		const std::function<bool(RigidBody*)>& callback);
+
+	/// @brief Report the bodies whose collider AABB touches the sphere
+	void QuerySphere(const glm::vec3& center, float radius, const std::function<bool(RigidBody*)>& filter,
+		const std::function<bool(RigidBody*)>& callback);
+
+	/// @brief Report the bodies whose collider AABB is at least partly inside
+	/// the frustum, see Frustum::FromMatrix to cull with a camera
+	void QueryFrustum(const Frustum& frustum, const std::function<bool(RigidBody*)>& filter,
+		const std::function<bool(RigidBody*)>& callback);
+
+	/// @brief Queries writing into a caller owned array, they stop once it is full
+	/// @param results - Room for capacity bodies
+	/// @return Number of bodies written
+	int QueryAABB(const AABB& aabb, RigidBody** results, int capacity,
+		const std::function<bool(RigidBody*)>& filter = nullptr);
+	int QuerySphere(const glm::vec3& center, float radius, RigidBody** results, int capacity,
+		const std::function<bool(RigidBody*)>& filter = nullptr);
+	int QueryFrustum(const Frustum& frustum, RigidBody** results, int capacity,
+		const std::function<bool(RigidBody*)>& filter = nullptr);
+
+
 	/// @brief Remove a gameobject from the physics world
 	/// @param obj - Physics Game Object
 	void RemovePhysicsObject(Object* obj);
@@ -55,7 +145,15 @@ public:
 	/// @return Vector of of all softbody physics game objects
 	//std::vector<std::shared_ptr<Object>>& GetSoftBodyPhysicsObjects();
 
-	AABBDynamicTree* tree;
+	/// @brief Switch the broadphase backend, every object is added to the new one
+	void SetBroadphase(BroadphaseType type);
+	BroadphaseType GetBroadphaseType() const { return m_broadphaseType; }
+
+	/// @brief Narrowphase functions by collider types, register new ones here
+	CollisionDispatcher& GetDispatcher() { return m_dispatcher; }
+
+	Broadphase* broadphase;
+	float m_broadphaseTime = 0.f; // ms spent on proxy updates and pairs last step
 	bool m_EnableGravity = true;
 	int m_velocitySolveIt = 20;
 	int m_positionSolveIt = 10;
@@ -70,16 +168,18 @@ protected:
 	/// @brief GOs with just a Collider comp.
 	//std::vector<std::shared_ptr<Object>> m_SoftBodyPhysicsObjects;
 
-	/// @brief Queue of all collisions detected in this frame
-	std::vector<std::shared_ptr<CollisionData>> m_CollisionQueue;
+	/// @brief Manifolds of all collisions detected in this frame, kept
+	/// across frames so a pair found again reuses its manifold
+	PairCache m_pairCache;
+
+	/// @brief Narrowphase function of each pair of collider types
+	CollisionDispatcher m_dispatcher;
 
 	///// @brief Queue of all collisions detected in this frame
 	//std::vector<CollisionData> m_TriggerQueue;
 
 private:
 
-	void DetectCollisionThread(int parent);
-
 	/// @brief /// Check if two bodies are colliding.
 	/// If so, add to collision queue
 	/// @param colA - RigidBody of first colliding object
@@ -123,9 +223,16 @@ private:
 	/// @param dt - Delta time
 	void Integrate(float dt);
 
+	/// @brief Recompute world space collider data and the AABB
+	void UpdateCollider(RigidBody& rb);
+
 	void SolveVelocityConstraint(std::shared_ptr<CollisionData> col, float dt);
 
 
+	BroadphaseType m_broadphaseType = BroadphaseType::TREE;
+	std::function<bool(RigidBody*, RigidBody*)> m_pairFilter;
+	Shape* aabbBox;
+
 	/// @brief World gravity
 	glm::vec3 m_Gravity{ 0.f,0.f,-9.8f };
 
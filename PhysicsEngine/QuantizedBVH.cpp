@@ -0,0 +1,131 @@
+#include "QuantizedBVH.h"
+#include "BVH.h"
+#include <algorithm>
+#include <cmath>
+
+void QuantizedBVH::Build(const AABBDynamicTree& tree)
+{
+	nodes.clear();
+	bodies.clear();
+
+	if (tree.rootIndex == NULL_NODE)
+		return;
+
+	bounds = tree.nodes[tree.rootIndex].m_box;
+
+	glm::vec3 size = bounds.m_upper - bounds.m_lower;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		//a flat root would divide by zero, any scale works for it
+		float extent = std::max(size[axis], 1e-6f);
+		scale[axis] = 65535.f / extent;
+		invScale[axis] = extent / 65535.f;
+	}
+
+	nodes.reserve(2 * tree.GetProxyCount());
+	bodies.reserve(tree.GetProxyCount());
+	BuildNode(tree, tree.rootIndex);
+}
+
+int QuantizedBVH::BuildNode(const AABBDynamicTree& tree, int index)
+{
+	const Node& node = tree.nodes[index];
+
+	int quantizedIndex = (int)nodes.size();
+	nodes.emplace_back();
+	Quantize(node.m_box.m_lower, node.m_box.m_upper, nodes[quantizedIndex].m_min, nodes[quantizedIndex].m_max);
+
+	if (node.IsLeaf())
+	{
+		nodes[quantizedIndex].m_data = (int)bodies.size();
+		bodies.push_back(node.m_clientData);
+		return quantizedIndex;
+	}
+
+	//the left subtree follows directly, a miss skips the whole subtree
+	BuildNode(tree, node.m_left);
+	BuildNode(tree, node.m_right);
+	nodes[quantizedIndex].m_data = quantizedIndex - (int)nodes.size();
+	return quantizedIndex;
+}
+
+void QuantizedBVH::Quantize(const glm::vec3& lower, const glm::vec3& upper, unsigned short* qMin, unsigned short* qMax) const
+{
+	//round the lower corner down and the upper corner up so the box only grows
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float lo = std::floor((lower[axis] - bounds.m_lower[axis]) * scale[axis]);
+		float hi = std::ceil((upper[axis] - bounds.m_lower[axis]) * scale[axis]);
+		qMin[axis] = (unsigned short)std::min(std::max(lo, 0.f), 65535.f);
+		qMax[axis] = (unsigned short)std::min(std::max(hi, 0.f), 65535.f);
+	}
+}
+
+void QuantizedBVH::Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback) const
+{
+	//clamping below would pull a box outside the root onto its border
+	if (nodes.empty() || !bounds.Overlaps(aabb))
+		return;
+
+	unsigned short qMin[3], qMax[3];
+	Quantize(aabb.m_lower, aabb.m_upper, qMin, qMax);
+
+	int i = 0;
+	int count = (int)nodes.size();
+	while (i < count)
+	{
+		const QuantizedNode& node = nodes[i];
+		bool overlap = Overlaps(node, qMin, qMax);
+
+		if (node.m_data >= 0)
+		{
+			if (overlap && !callback(bodies[node.m_data]))
+				return;
+			++i;
+		}
+		else
+			i += overlap ? 1 : -node.m_data;
+	}
+}
+
+void QuantizedBVH::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<float(RigidBody*, float)>& callback) const
+{
+	if (nodes.empty())
+		return;
+
+	glm::vec3 invDir = 1.0f / direction;
+	glm::vec3 offset = bounds.m_lower - origin;
+
+	int i = 0;
+	int count = (int)nodes.size();
+	while (i < count)
+	{
+		const QuantizedNode& node = nodes[i];
+
+		//slab test on the dequantized box, world plane = bounds + q * invScale
+		float t = 0.f;
+		float tExit = maxT;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float t0 = (node.m_min[axis] * invScale[axis] + offset[axis]) * invDir[axis];
+			float t1 = (node.m_max[axis] * invScale[axis] + offset[axis]) * invDir[axis];
+			t = std::max(t, std::min(t0, t1));
+			tExit = std::min(tExit, std::max(t0, t1));
+		}
+		bool hit = t <= tExit;
+
+		if (node.m_data >= 0)
+		{
+			if (hit)
+			{
+				maxT = callback(bodies[node.m_data], t);
+				if (maxT <= 0.f)
+					return;
+			}
+			++i;
+		}
+		else
+			i += hit ? 1 : -node.m_data;
+	}
+}
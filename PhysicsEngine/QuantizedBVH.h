@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Collider.h"
+#include <functional>
+
+class AABBDynamicTree;
+class RigidBody;
+
+// Compact read-only snapshot of an AABBDynamicTree. Node bounds are stored
+// as 16 bit offsets inside the root box, rounded outward so every box is
+// still contained, and the nodes are laid out depth first : an internal
+// node is followed by its left subtree and stores how far to skip when it
+// is missed. A node takes 16 bytes instead of the ~60 of a tree node, so
+// large worlds stay in cache while running many queries in a step.
+// Queries report a few more bodies than the full precision tree would,
+// never less
+class QuantizedBVH
+{
+public:
+	/// @brief Rebuild the snapshot from the current state of tree
+	void Build(const AABBDynamicTree& tree);
+
+	/// @brief Report every body whose quantized fat box overlaps aabb
+	/// @param callback - Return false to stop
+	void Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback) const;
+
+	/// @brief Report every body whose quantized fat box is hit by origin + t * direction
+	/// @param callback - Called with the body and the entry t. Returns the new
+	/// maxT to clip the ray, 0 stops the cast
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(RigidBody*, float)>& callback) const;
+
+	void Clear() { nodes.clear(); bodies.clear(); }
+	bool IsEmpty() const { return nodes.empty(); }
+
+	/// @brief Bytes used by the nodes and the body table
+	size_t GetMemorySize() const { return nodes.size() * sizeof(QuantizedNode) + bodies.size() * sizeof(RigidBody*); }
+
+private:
+	struct QuantizedNode
+	{
+		unsigned short m_min[3];
+		unsigned short m_max[3];
+		int m_data; // leaf : index in bodies, internal : minus the size of its subtree
+	};
+
+	static_assert(sizeof(QuantizedNode) == 16, "QuantizedNode should stay 16 bytes");
+
+	int BuildNode(const AABBDynamicTree& tree, int index);
+
+	void Quantize(const glm::vec3& lower, const glm::vec3& upper, unsigned short* qMin, unsigned short* qMax) const;
+
+	bool Overlaps(const QuantizedNode& node, const unsigned short* qMin, const unsigned short* qMax) const
+	{
+		return node.m_min[0] <= qMax[0] && node.m_max[0] >= qMin[0]
+			&& node.m_min[1] <= qMax[1] && node.m_max[1] >= qMin[1]
+			&& node.m_min[2] <= qMax[2] && node.m_max[2] >= qMin[2];
+	}
+
+	std::vector<QuantizedNode> nodes;
+	std::vector<RigidBody*> bodies;
+
+	AABB bounds; // root box the offsets are relative to
+	glm::vec3 scale = glm::vec3(0.f); // world to quantized
+	glm::vec3 invScale = glm::vec3(0.f); // quantized to world
+};
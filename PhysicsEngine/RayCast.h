@@ -0,0 +1,200 @@
+#pragma once
+
+#include "RigidBody.h"
+
+enum class RayCastMode
+{
+	CLOSEST, // nearest hit along the ray
+	ANY      // first hit found, for line of sight
+};
+
+struct RayHit
+{
+	RigidBody* m_body = nullptr;
+	float m_t = 0.f;        // hit point is origin + m_t * direction
+	glm::vec3 m_point;
+	glm::vec3 m_normal;
+};
+
+//A ray starting inside a collider hits it at t = 0, facing back along the ray
+static void RayStartsInside(const glm::vec3& origin, const glm::vec3& direction, RayHit& hit)
+{
+	hit.m_t = 0.f;
+	hit.m_point = origin;
+	hit.m_normal = -glm::normalize(direction);
+}
+
+static bool RaySphere(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+					  const SphereCollider& sphere, RayHit& hit)
+{
+	glm::vec3 m = origin - sphere.m_position;
+	float b = glm::dot(m, direction);
+	float c = glm::dot(m, m) - sphere.m_radius * sphere.m_radius;
+
+	//outside and pointing away
+	if (c > 0.f && b > 0.f)
+		return false;
+
+	if (c <= 0.f)
+	{
+		RayStartsInside(origin, direction, hit);
+		return true;
+	}
+
+	float a = glm::dot(direction, direction);
+	float discriminant = b * b - a * c;
+	if (discriminant < 0.f)
+		return false;
+
+	float t = (-b - std::sqrt(discriminant)) / a;
+	if (t > maxT)
+		return false;
+
+	hit.m_t = t;
+	hit.m_point = origin + direction * t;
+	hit.m_normal = (hit.m_point - sphere.m_position) / sphere.m_radius;
+	return true;
+}
+
+static bool RayOBB(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+				   const Collider& box, RayHit& hit)
+{
+	//Slab test against the unit box in the box frame. The ray goes through the
+	//inverse of the same matrix as the vertices and the AABB, t is unchanged
+	glm::mat4 toLocal = glm::inverse(glm::toMat4(box.m_rotation) * Scale(box.m_scale.x, box.m_scale.y, box.m_scale.z));
+	glm::vec3 localOrigin = glm::vec3(toLocal * glm::vec4(origin - box.m_position, 0.f));
+	glm::vec3 localDirection = glm::vec3(toLocal * glm::vec4(direction, 0.f));
+
+	float tEnter = 0.f;
+	float tExit = maxT;
+	int enterAxis = -1;
+	float enterSign = 0.f;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		float o = localOrigin[i];
+		float d = localDirection[i];
+
+		if (std::abs(d) < 1e-8f)
+		{
+			if (o < -1.f || o > 1.f)
+				return false;
+			continue;
+		}
+
+		float t0 = (-1.f - o) / d;
+		float t1 = (1.f - o) / d;
+		float sign = -1.f; // entering through the -1 face
+		if (t0 > t1)
+		{
+			std::swap(t0, t1);
+			sign = 1.f;
+		}
+
+		if (t0 > tEnter)
+		{
+			tEnter = t0;
+			enterAxis = i;
+			enterSign = sign;
+		}
+		tExit = std::min(tExit, t1);
+
+		if (tEnter > tExit)
+			return false;
+	}
+
+	if (enterAxis == -1)
+	{
+		RayStartsInside(origin, direction, hit);
+		return true;
+	}
+
+	//normals go through the inverse transpose, row enterAxis of toLocal
+	glm::vec3 normal(toLocal[0][enterAxis], toLocal[1][enterAxis], toLocal[2][enterAxis]);
+
+	hit.m_t = tEnter;
+	hit.m_point = origin + direction * tEnter;
+	hit.m_normal = glm::normalize(normal) * enterSign;
+	return true;
+}
+
+static bool RayConvex(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+					  const ConvexCollider& convex, RayHit& hit)
+{
+	//Clip the ray against every face plane. The planes come from the world
+	//vertices, the stored normal only picks the outward side
+	float tEnter = 0.f;
+	float tExit = maxT;
+	int enterFace = -1;
+	glm::vec3 enterNormal;
+
+	for (size_t i = 0; i < convex.m_faces.size(); ++i)
+	{
+		const std::vector<size_t>& face = convex.m_faces[i].first;
+		const glm::vec3& planePoint = convex.m_vertices[face[0]];
+		glm::vec3 normal = glm::cross(convex.m_vertices[face[1]] - planePoint, convex.m_vertices[face[2]] - planePoint);
+		if (glm::dot(normal, convex.m_faces[i].second) < 0.f)
+			normal = -normal;
+
+		float distance = glm::dot(normal, origin - planePoint); // > 0 outside
+		float denom = glm::dot(normal, direction);
+
+		if (std::abs(denom) < 1e-8f)
+		{
+			if (distance > 0.f)
+				return false;
+			continue;
+		}
+
+		float t = -distance / denom;
+		if (denom < 0.f)
+		{
+			if (t > tEnter)
+			{
+				tEnter = t;
+				enterFace = (int)i;
+				enterNormal = normal;
+			}
+		}
+		else
+			tExit = std::min(tExit, t);
+
+		if (tEnter > tExit)
+			return false;
+	}
+
+	if (enterFace == -1)
+	{
+		RayStartsInside(origin, direction, hit);
+		return true;
+	}
+
+	hit.m_t = tEnter;
+	hit.m_point = origin + direction * tEnter;
+	hit.m_normal = glm::normalize(enterNormal);
+	return true;
+}
+
+/// @brief Exact test of the ray origin + t * direction, t in [0, maxT], against the collider of body
+static bool RayCastBody(RigidBody* body, const glm::vec3& origin, const glm::vec3& direction, float maxT, RayHit& hit)
+{
+	bool result = false;
+	switch (body->m_collider->m_type)
+	{
+	case BoundingType::SPHERE:
+		result = RaySphere(origin, direction, maxT, *std::static_pointer_cast<SphereCollider>(body->m_collider), hit);
+		break;
+	case BoundingType::BOX:
+		result = RayOBB(origin, direction, maxT, *body->m_collider, hit);
+		break;
+	case BoundingType::CONVEX:
+		result = RayConvex(origin, direction, maxT, *std::static_pointer_cast<ConvexCollider>(body->m_collider), hit);
+		break;
+	default:
+		break;
+	}
+
+	if (result)
+		hit.m_body = body;
+	return result;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "Collider.h"
+#include "Simd.h"
+
+// Up to 8 rays traversed together. Origins, inverse directions and the
+// current maxT are stored per axis so one box is slab tested against all
+// rays at once. Unused lanes have a negative maxT and never hit
+struct RayPacket
+{
+	static const int SIZE = 8;
+
+	RayPacket()
+	{
+		for (int i = 0; i < SIZE; ++i)
+		{
+			m_originX[i] = m_originY[i] = m_originZ[i] = 0.f;
+			m_invDirX[i] = m_invDirY[i] = m_invDirZ[i] = 1.f;
+			m_maxT[i] = -1.f;
+		}
+	}
+
+	/// @brief Add the ray origin + t * direction, t in [0, maxT]
+	/// @return Lane of the ray, -1 if the packet is full
+	int Add(const glm::vec3& origin, const glm::vec3& direction, float maxT)
+	{
+		if (m_count == SIZE)
+			return -1;
+
+		int i = m_count++;
+		glm::vec3 invDir = 1.0f / direction;
+		m_origin[i] = origin;
+		m_direction[i] = direction;
+		m_originX[i] = origin.x;
+		m_originY[i] = origin.y;
+		m_originZ[i] = origin.z;
+		m_invDirX[i] = invDir.x;
+		m_invDirY[i] = invDir.y;
+		m_invDirZ[i] = invDir.z;
+		m_maxT[i] = maxT;
+		return i;
+	}
+
+	/// @brief Lanes still looking for hits
+	int ActiveMask() const
+	{
+		int mask = 0;
+		for (int i = 0; i < m_count; ++i)
+		{
+			if (m_maxT[i] > 0.f)
+				mask |= 1 << i;
+		}
+		return mask;
+	}
+
+	/// @brief Slab test of box against every ray of the packet
+	/// @param tEnter - Entry t of each lane, valid for the lanes in the result
+	/// @return Bit i set if ray i hits the box
+	int Intersect(const AABB& box, float* tEnter) const
+	{
+#ifdef PHYSICS_SSE
+		int mask = 0;
+		for (int half = 0; half < SIZE; half += 4)
+		{
+			__m128 ox = _mm_loadu_ps(m_originX + half);
+			__m128 oy = _mm_loadu_ps(m_originY + half);
+			__m128 oz = _mm_loadu_ps(m_originZ + half);
+			__m128 ix = _mm_loadu_ps(m_invDirX + half);
+			__m128 iy = _mm_loadu_ps(m_invDirY + half);
+			__m128 iz = _mm_loadu_ps(m_invDirZ + half);
+
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.m_lower.x), ox), ix);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.m_upper.x), ox), ix);
+			__m128 tMin = _mm_min_ps(t0, t1);
+			__m128 tMax = _mm_max_ps(t0, t1);
+
+			t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.m_lower.y), oy), iy);
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.m_upper.y), oy), iy);
+			tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+			tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+
+			t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.m_lower.z), oz), iz);
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.m_upper.z), oz), iz);
+			tMin = _mm_max_ps(tMin, _mm_min_ps(t0, t1));
+			tMax = _mm_min_ps(tMax, _mm_max_ps(t0, t1));
+
+			tMin = _mm_max_ps(tMin, _mm_setzero_ps());
+			tMax = _mm_min_ps(tMax, _mm_loadu_ps(m_maxT + half));
+
+			_mm_storeu_ps(tEnter + half, tMin);
+			mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << half;
+		}
+		return mask;
+#else
+		int mask = 0;
+		for (int i = 0; i < m_count; ++i)
+		{
+			glm::vec3 origin(m_originX[i], m_originY[i], m_originZ[i]);
+			glm::vec3 invDir(m_invDirX[i], m_invDirY[i], m_invDirZ[i]);
+			if (box.RayIntersect(origin, invDir, m_maxT[i], tEnter[i]))
+				mask |= 1 << i;
+		}
+		return mask;
+#endif
+	}
+
+	float m_originX[SIZE], m_originY[SIZE], m_originZ[SIZE];
+	float m_invDirX[SIZE], m_invDirY[SIZE], m_invDirZ[SIZE];
+	float m_maxT[SIZE];
+
+	glm::vec3 m_origin[SIZE];
+	glm::vec3 m_direction[SIZE];
+	int m_count = 0;
+};
@@ -12,7 +12,7 @@ void RigidBody::Initialize()
 	//cube
 	float r = m_collider->m_scale.x * 2.f;
 	float m = 1.0f / m_inverseMass;
-	if (m_collider->m_type == BoundingType::CONVEX)
+	if (m_collider->m_type == BoundingType::CONVEX || m_collider->m_type == BoundingType::BOX)
 	{
 		//calculate inertia tensor
 		float mul = 1.0f / m_inverseMass * r * r;
@@ -2,6 +2,25 @@
 
 #include "Collider.h"
 
+// Which bodies may collide, tested by the broadphase before a pair is made.
+// Two bodies of the same nonzero group always collide if the group is
+// positive and never if it is negative. Otherwise each body's category
+// must be in the other's mask
+struct CollisionFilter
+{
+	unsigned short m_category = 0x0001;
+	unsigned short m_mask = 0xFFFF;
+	short m_group = 0;
+
+	bool ShouldCollide(const CollisionFilter& other) const
+	{
+		if (m_group == other.m_group && m_group != 0)
+			return m_group > 0;
+
+		return (m_mask & other.m_category) != 0 && (other.m_mask & m_category) != 0;
+	}
+};
+
 class RigidBody 
 {
 public:
@@ -177,6 +196,13 @@ public:
 
 	std::shared_ptr<Collider> m_collider;
 
+	/// @brief Proxy id in the broadphase, -1 if not inserted
+	int m_proxyId = -1;
+
+	/// @brief Copied into the proxy when added, change it on an added body
+	/// through Physics::SetCollisionFilter
+	CollisionFilter m_filter;
+
 private:
 
 	glm::vec3 m_centerOfMass;
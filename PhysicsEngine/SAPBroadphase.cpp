@@ -0,0 +1,315 @@
+#include "SAPBroadphase.h"
+
+SAPBroadphase::SAPBroadphase(Shape* box) : aabbBox(box)
+{
+}
+
+void SAPBroadphase::AddProxy(RigidBody* body)
+{
+	int proxyId;
+	if (freeList == -1)
+	{
+		proxyId = (int)proxies.size();
+		proxies.emplace_back();
+	}
+	else
+	{
+		proxyId = freeList;
+		freeList = proxies[proxyId].m_next;
+	}
+
+	Proxy& proxy = proxies[proxyId];
+	proxy.m_box = FattenAABB(body->m_collider->m_aabb, glm::vec3(0.f));
+	proxy.m_clientData = body;
+	proxy.m_filter = body->m_filter;
+	proxy.m_static = !body->IsDynamic();
+	proxy.m_colliding = false;
+	proxy.m_next = -1;
+
+	//Append at the end, the sort walks the endpoints down and finds the pairs
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		std::vector<Endpoint>& ep = endpoints[axis];
+		proxy.m_min[axis] = (int)ep.size();
+		ep.push_back({ proxy.m_box.m_lower[axis], proxyId << 1 });
+		proxy.m_max[axis] = (int)ep.size();
+		ep.push_back({ proxy.m_box.m_upper[axis], (proxyId << 1) | 1 });
+	}
+
+	body->m_proxyId = proxyId;
+	UpdatePairs();
+}
+
+void SAPBroadphase::RemoveProxy(RigidBody* body)
+{
+	int proxyId = body->m_proxyId;
+
+	//RemovePair moves the last pair into the hole, walking backward visits each pair once
+	for (int i = (int)pairs.size() - 1; i >= 0; --i)
+	{
+		if (pairs[i].first == proxyId || pairs[i].second == proxyId)
+			RemovePair(pairs[i].first, pairs[i].second);
+	}
+
+	Proxy& proxy = proxies[proxyId];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		std::vector<Endpoint>& ep = endpoints[axis];
+		int minIndex = proxy.m_min[axis];
+		ep.erase(ep.begin() + proxy.m_max[axis]);
+		ep.erase(ep.begin() + minIndex);
+
+		for (int i = minIndex; i < (int)ep.size(); ++i)
+		{
+			Proxy& other = proxies[ep[i].ProxyId()];
+			if (ep[i].IsMax())
+				other.m_max[axis] = i;
+			else
+				other.m_min[axis] = i;
+		}
+	}
+
+	proxy.m_clientData = nullptr;
+	proxy.m_next = freeList;
+	freeList = proxyId;
+	body->m_proxyId = -1;
+}
+
+void SAPBroadphase::MoveProxy(RigidBody* body)
+{
+	SetBox(body->m_proxyId, FattenAABB(body->m_collider->m_aabb, glm::vec3(0.f)));
+}
+
+void SAPBroadphase::RefilterProxy(RigidBody* body)
+{
+	int proxyId = body->m_proxyId;
+	proxies[proxyId].m_filter = body->m_filter;
+
+	for (int i = (int)pairs.size() - 1; i >= 0; --i)
+	{
+		int proxyA = pairs[i].first;
+		int proxyB = pairs[i].second;
+		if ((proxyA == proxyId || proxyB == proxyId) && !ShouldPair(proxyA, proxyB))
+			RemovePair(proxyA, proxyB);
+	}
+
+	//AddPair skips the pairs already there
+	Query(proxies[proxyId].m_box, [&](RigidBody* other)
+		{
+			if (other->m_proxyId != proxyId)
+				AddPair(proxyId, other->m_proxyId);
+			return true;
+		});
+}
+
+void SAPBroadphase::UpdateProxy(RigidBody* body, const glm::vec3& displacement)
+{
+	const AABB& aabb = body->m_collider->m_aabb;
+	const AABB& box = proxies[body->m_proxyId].m_box;
+	glm::vec3 d = displacementMultiplier * displacement;
+
+	if (box.Contains(aabb))
+	{
+		//Still inside, refit only if the box grew far larger than needed
+		glm::vec3 slack = 4.0f * (glm::vec3(extent) + glm::abs(d));
+		AABB huge;
+		huge.m_lower = aabb.m_lower - slack;
+		huge.m_upper = aabb.m_upper + slack;
+		if (huge.Contains(box))
+			return;
+	}
+
+	SetBox(body->m_proxyId, FattenAABB(aabb, d));
+}
+
+void SAPBroadphase::ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback)
+{
+	for (Proxy& proxy : proxies)
+		proxy.m_colliding = false;
+
+	for (const auto& p : pairs)
+	{
+		Proxy* a = &proxies[p.first];
+		Proxy* b = &proxies[p.second];
+		if (a->m_static)
+			std::swap(a, b);
+
+		if (!callback(a->m_clientData, b->m_clientData))
+			continue;
+
+		a->m_colliding = true;
+		b->m_colliding = true;
+	}
+}
+
+void SAPBroadphase::Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback)
+{
+	//every box overlapping aabb starts before its end on x
+	const std::vector<Endpoint>& ep = endpoints[0];
+	for (int i = 0; i < (int)ep.size() && ep[i].m_value <= aabb.m_upper.x; ++i)
+	{
+		if (ep[i].IsMax())
+			continue;
+
+		const Proxy& proxy = proxies[ep[i].ProxyId()];
+		if (proxy.m_box.Overlaps(aabb) && !callback(proxy.m_clientData))
+			return;
+	}
+}
+
+void SAPBroadphase::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<float(RigidBody*, float)>& callback)
+{
+	glm::vec3 invDir = 1.0f / direction;
+
+	for (const Proxy& proxy : proxies)
+	{
+		float t;
+		if (proxy.m_clientData == nullptr || !proxy.m_box.RayIntersect(origin, invDir, maxT, t))
+			continue;
+
+		maxT = callback(proxy.m_clientData, t);
+		if (maxT <= 0.f)
+			return;
+	}
+}
+
+void SAPBroadphase::Draw(int programId)
+{
+	for (const Proxy& proxy : proxies)
+	{
+		if (proxy.m_clientData)
+			proxy.m_box.Draw(programId, aabbBox, proxy.m_colliding);
+	}
+}
+
+void SAPBroadphase::UpdatePairs()
+{
+	for (int axis = 0; axis < 3; ++axis)
+		SortAxis(axis);
+}
+
+void SAPBroadphase::SetBox(int proxyId, const AABB& box)
+{
+	Proxy& proxy = proxies[proxyId];
+	proxy.m_box = box;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		endpoints[axis][proxy.m_min[axis]].m_value = box.m_lower[axis];
+		endpoints[axis][proxy.m_max[axis]].m_value = box.m_upper[axis];
+	}
+}
+
+void SAPBroadphase::SortAxis(int axis)
+{
+	//Insertion sort swaps every out of order couple of endpoints exactly once.
+	//All boxes already hold their new values, so a swap of a min with a max
+	//tells for sure whether the two boxes started or stopped overlapping
+	std::vector<Endpoint>& ep = endpoints[axis];
+	int count = (int)ep.size();
+	bool swapped = false;
+
+	for (int i = 1; i < count; ++i)
+	{
+		Endpoint moving = ep[i];
+		int j = i;
+		while (j > 0 && ep[j - 1].m_value > moving.m_value)
+		{
+			const Endpoint& prev = ep[j - 1];
+			if (moving.IsMax() != prev.IsMax())
+			{
+				int proxyA = moving.ProxyId();
+				int proxyB = prev.ProxyId();
+
+				//min passing a max to its left : may start overlapping
+				//max passing a min to its left : separated on this axis
+				if (!moving.IsMax())
+				{
+					if (proxies[proxyA].m_box.Overlaps(proxies[proxyB].m_box))
+						AddPair(proxyA, proxyB);
+				}
+				else
+					RemovePair(proxyA, proxyB);
+			}
+
+			ep[j] = prev;
+			--j;
+		}
+
+		if (j != i)
+		{
+			ep[j] = moving;
+			swapped = true;
+		}
+	}
+
+	if (!swapped)
+		return;
+
+	for (int i = 0; i < count; ++i)
+	{
+		Proxy& proxy = proxies[ep[i].ProxyId()];
+		if (ep[i].IsMax())
+			proxy.m_max[axis] = i;
+		else
+			proxy.m_min[axis] = i;
+	}
+}
+
+bool SAPBroadphase::ShouldPair(int proxyA, int proxyB) const
+{
+	const Proxy& A = proxies[proxyA];
+	const Proxy& B = proxies[proxyB];
+	if (A.m_static && B.m_static)
+		return false;
+
+	return A.m_filter.ShouldCollide(B.m_filter) && AcceptPair(A.m_clientData, B.m_clientData);
+}
+
+void SAPBroadphase::AddPair(int proxyA, int proxyB)
+{
+	if (!ShouldPair(proxyA, proxyB))
+		return;
+
+	unsigned long long key = PairKey(proxyA, proxyB);
+	if (pairIndex.find(key) != pairIndex.end())
+		return;
+
+	pairIndex[key] = (int)pairs.size();
+	pairs.emplace_back(proxyA, proxyB);
+}
+
+void SAPBroadphase::RemovePair(int proxyA, int proxyB)
+{
+	auto it = pairIndex.find(PairKey(proxyA, proxyB));
+	if (it == pairIndex.end())
+		return;
+
+	int index = it->second;
+	pairIndex.erase(it);
+
+	//fill the hole with the last pair
+	int last = (int)pairs.size() - 1;
+	if (index != last)
+	{
+		pairs[index] = pairs[last];
+		pairIndex[PairKey(pairs[index].first, pairs[index].second)] = index;
+	}
+	pairs.pop_back();
+}
+
+AABB SAPBroadphase::FattenAABB(const AABB& aabb, const glm::vec3& displacement) const
+{
+	AABB fat;
+	fat.m_lower = aabb.m_lower - extent;
+	fat.m_upper = aabb.m_upper + extent;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (displacement[i] < 0.f)
+			fat.m_lower[i] += displacement[i];
+		else
+			fat.m_upper[i] += displacement[i];
+	}
+	return fat;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Broadphase.h"
+#include <unordered_map>
+
+// Incremental sweep and prune. Every axis keeps the min and max endpoints of
+// all proxies sorted. Proxy updates only write the new endpoint values, then
+// one insertion sort per axis puts them back in order and updates the pair
+// set each time a min crosses a max. With coherent motion the arrays are
+// nearly sorted, so the cost follows how much the scene changed
+class SAPBroadphase : public Broadphase
+{
+public:
+	SAPBroadphase(Shape* box);
+
+	void AddProxy(RigidBody* body) override;
+	void RemoveProxy(RigidBody* body) override;
+	void MoveProxy(RigidBody* body) override;
+
+	/// @brief Drops the pairs the new filter rejects right away and searches
+	/// the proxy's box for the pairs it now allows
+	void RefilterProxy(RigidBody* body) override;
+	void UpdateProxy(RigidBody* body, const glm::vec3& displacement) override;
+
+	/// @brief Sort the endpoints moved since the last call, updating the pairs
+	void UpdatePairs() override;
+	void ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback) override;
+
+	/// @brief Sweeps the x axis up to the end of aabb
+	void Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback) override;
+
+	/// @brief Tests every proxy, sweep and prune has no hierarchy to skip empty space
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(RigidBody*, float)>& callback) override;
+
+	void Draw(int programId) override;
+	const char* GetName() const override { return "Sweep and Prune"; }
+
+private:
+	struct Endpoint
+	{
+		float m_value;
+		int m_data; // proxy id << 1 | 1 for a max endpoint
+
+		int ProxyId() const { return m_data >> 1; }
+		bool IsMax() const { return (m_data & 1) != 0; }
+	};
+
+	struct Proxy
+	{
+		AABB m_box;
+		RigidBody* m_clientData; // nullptr while the proxy is on the free list
+		int m_min[3]; // endpoint indices on each axis
+		int m_max[3];
+		int m_next;
+		CollisionFilter m_filter;
+		bool m_static;
+		bool m_colliding;
+	};
+
+	/// @brief Change the box of a proxy, the endpoints are sorted by UpdatePairs
+	void SetBox(int proxyId, const AABB& box);
+	void SortAxis(int axis);
+
+	/// @brief Not both static, the filters agree and the pair filter accepts it
+	bool ShouldPair(int proxyA, int proxyB) const;
+	void AddPair(int proxyA, int proxyB);
+	void RemovePair(int proxyA, int proxyB);
+
+	static unsigned long long PairKey(int proxyA, int proxyB)
+	{
+		if (proxyA > proxyB)
+			std::swap(proxyA, proxyB);
+		return ((unsigned long long)proxyA << 32) | (unsigned int)proxyB;
+	}
+
+	AABB FattenAABB(const AABB& aabb, const glm::vec3& displacement) const;
+
+	std::vector<Proxy> proxies;
+	std::vector<Endpoint> endpoints[3];
+
+	std::vector<std::pair<int, int>> pairs;
+	std::unordered_map<unsigned long long, int> pairIndex; // key -> index in pairs
+
+	int freeList = -1;
+	Shape* aabbBox;
+
+	float extent = 0.1f;
+	float displacementMultiplier = 2.0f;
+};
@@ -5,21 +5,28 @@
 #include "Helper.h"
 #include <vector>
 
+//Motion of b relative to a under which a cached contact axis is reused
+//without searching again
+#define SAT_CACHE_LINEAR_SLOP 0.005f
+#define SAT_CACHE_ANGULAR_SLOP 0.99999f
 
-static glm::vec2 SAT(const glm::vec3& axis, RigidBody* col)
+
+/// @brief Interval of a box along axis. The box is the unit box through a
+/// transform with the given center and columns, it reaches center +- each
+/// column, so it projects to the center +- the sum of |axis . column|
+static glm::vec2 SATBox(const glm::vec3& axis, const glm::vec3& center, const glm::mat3& halfAxes)
 {
-	glm::vec2 minmax{ FLT_MAX,-FLT_MAX };
-	for (int i = 0; i < box_verts.size(); ++i)
-	{
-		glm::vec3 currPt = glm::vec3(col->m_collider->m_objTr * glm::vec4(box_verts[i],1.f));
-		float dot = glm::dot(currPt, axis);
-		if (dot < minmax.x)
-			minmax.x = dot;
-		if (dot > minmax.y)
-			minmax.y = dot;
-	}
+	float c = glm::dot(center, axis);
+	float r = std::abs(glm::dot(halfAxes[0], axis)) + std::abs(glm::dot(halfAxes[1], axis))
+		+ std::abs(glm::dot(halfAxes[2], axis));
+	return glm::vec2(c - r, c + r);
+}
 
-	return minmax;
+/// @brief Interval of a box or convex collider (unit box through m_objTr) along axis
+static glm::vec2 SAT(const glm::vec3& axis, RigidBody* col)
+{
+	const glm::mat4& tr = col->m_collider->m_objTr;
+	return SATBox(axis, glm::vec3(tr[3]), glm::mat3(tr));
 }
 
 static bool overlaps(const glm::vec2& minmax1, const glm::vec2& minmax2)
@@ -114,18 +121,142 @@ static float DistanceEdgeEdge(std::shared_ptr<ConvexCollider> a, std::shared_ptr
 	return -glm::dot(sepAxis, edgeBStart - edgeAStart);
 }
 
+/// @brief Gauss map test : an edge is the arc between the normals of its two
+/// faces, and two edges only build a face of the Minkowski difference if
+/// the arc of a crosses the arc of b mirrored. Other edge pairs cannot hold
+/// the separating axis (Gregorius, The Separating Axis Test between Convex Polyhedra)
 static bool EdgeBuildMinkowski(std::shared_ptr<ConvexCollider> a, std::shared_ptr<ConvexCollider> b,
 								size_t edge1, size_t edge2)
 {
-	glm::vec3 n1 = a->m_faces[a->m_edges[edge1].second].second;
-	//glm::vec3 n2
+	const glm::vec3& n1 = a->m_faces[a->m_edges[edge1].second].second;
+	const glm::vec3& n2 = a->m_faces[a->m_edges[a->m_edgeTwins[edge1]].second].second;
+	glm::vec3 n3 = -b->m_faces[b->m_edges[edge2].second].second;
+	glm::vec3 n4 = -b->m_faces[b->m_edges[b->m_edgeTwins[edge2]].second].second;
+
+	//the planes through each arc, n2 x n1 and n4 x n3 lie along the edges
+	glm::vec3 n2n1 = glm::cross(n2, n1);
+	glm::vec3 n4n3 = glm::cross(n4, n3);
+
+	float cba = glm::dot(n3, n2n1);
+	float dba = glm::dot(n4, n2n1);
+	float adc = glm::dot(n1, n4n3);
+	float bdc = glm::dot(n2, n4n3);
+
+	//both arcs straddle the other's plane, on the same hemisphere
+	return cba * dba < 0.f && adc * bdc < 0.f && cba * bdc > 0.f;
+}
+
+/// @brief Pose of b in the frame of a, to tell if a pair barely moved
+static void RelativePose(const Collider& a, const Collider& b, glm::quat& rotation, glm::vec3& position)
+{
+	glm::quat inverseA = glm::conjugate(a.m_rotation);
+	rotation = inverseA * b.m_rotation;
+	position = inverseA * (b.m_position - a.m_position);
+}
+
+/// @brief True if the cached axis made contact and b moved less than the
+/// slops relative to a since the axis was searched for
+static bool IsResting(const SeparatingAxisCache& cache, const Collider& a, const Collider& b)
+{
+	if (cache.m_type == SeparatingAxisCache::NONE || cache.m_depth <= 0.f)
+		return false;
+
+	glm::quat rotation;
+	glm::vec3 position;
+	RelativePose(a, b, rotation, position);
+	return glm::length2(position - cache.m_position) < SAT_CACHE_LINEAR_SLOP * SAT_CACHE_LINEAR_SLOP
+		&& std::abs(glm::dot(rotation, cache.m_rotation)) > SAT_CACHE_ANGULAR_SLOP;
+}
+
+/// @brief Depth of a and b along the cached axis of FindSparatingAxis
+/// @return False if the features no longer give an axis : an edge pair
+/// off the Minkowski difference or parallel
+static bool CachedAxisDepth(std::shared_ptr<ConvexCollider> a, std::shared_ptr<ConvexCollider> b,
+							const SeparatingAxisCache& cache, float& depth, glm::vec3& axis)
+{
+	switch (cache.m_type)
+	{
+	case SeparatingAxisCache::FACE_A:
+		SATFacePolygonGlobal(a, b, a->m_faces[cache.m_indexA], depth);
+		axis = a->m_faces[cache.m_indexA].second;
+		return true;
+	case SeparatingAxisCache::FACE_B:
+		SATFacePolygonGlobal(b, a, b->m_faces[cache.m_indexA], depth);
+		axis = b->m_faces[cache.m_indexA].second;
+		return true;
+	case SeparatingAxisCache::EDGES:
+	{
+		if (!EdgeBuildMinkowski(a, b, cache.m_indexA, cache.m_indexB))
+			return false;
+
+		const auto& verticesA = a->m_edges[cache.m_indexA].first;
+		const auto& verticesB = b->m_edges[cache.m_indexB].first;
+		glm::vec3 startA = a->m_vertices[verticesA.first];
+		glm::vec3 endA = a->m_vertices[verticesA.second];
+		glm::vec3 startB = b->m_vertices[verticesB.first];
+		glm::vec3 endB = b->m_vertices[verticesB.second];
+		if (glm::length2(glm::cross(glm::normalize(endA - startA), glm::normalize(endB - startB))) < 1e-6f)
+			return false;
+
+		depth = DistanceEdgeEdge(a, b, startA, endA, startB, endB, axis);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+/// @brief Record the axis that decided the pair, with the pose it was found at
+static void StoreAxis(SeparatingAxisCache& cache, const Collider& a, const Collider& b,
+					  SeparatingAxisCache::Type type, size_t indexA, size_t indexB, float depth)
+{
+	cache.m_type = type;
+	cache.m_indexA = (int)indexA;
+	cache.m_indexB = (int)indexB;
+	cache.m_depth = depth;
+	RelativePose(a, b, cache.m_rotation, cache.m_position);
 }
 
-static bool FindSparatingAxis(RigidBody* a, RigidBody* b, bool& flip, std::vector<ContactPoint>& cp)
+/// @param cache - Axis of the last test of the pair. A separating axis is
+/// tried first, and a resting contact is rebuilt on the same features
+/// without a search while the bodies barely move relative to each other
+static bool FindSparatingAxis(RigidBody* a, RigidBody* b, bool& flip, std::vector<ContactPoint>& cp,
+							  SeparatingAxisCache& cache)
 {
 	std::shared_ptr<ConvexCollider> colA = std::static_pointer_cast<ConvexCollider>(a->m_collider);
 	std::shared_ptr<ConvexCollider> colB = std::static_pointer_cast<ConvexCollider>(b->m_collider);
 
+	bool resting = IsResting(cache, *colA, *colB);
+	if (cache.m_type != SeparatingAxisCache::NONE && (cache.m_depth <= 0.f || resting))
+	{
+		float depth;
+		glm::vec3 axis;
+		if (CachedAxisDepth(colA, colB, cache, depth, axis))
+		{
+			//still apart along the last separating axis, or a contact that
+			//opened up : either way that axis proves the separation
+			if (depth <= 0.f)
+			{
+				cache.m_depth = depth;
+				return false;
+			}
+
+			if (resting)
+			{
+				cache.m_depth = depth;
+				if (cache.m_type == SeparatingAxisCache::EDGES)
+				{
+					flip = false;
+					return CreateEdgeContact(colA, colB, cache.m_indexA, cache.m_indexB, depth, axis, cp);
+				}
+
+				flip = cache.m_type == SeparatingAxisCache::FACE_B;
+				const auto& face = flip ? colB->m_faces[cache.m_indexA] : colA->m_faces[cache.m_indexA];
+				return CreateFaceContact(axis, flip, face.first, colA, colB, cp);
+			}
+		}
+	}
+
 	glm::vec3 diff = colA->m_position - colB->m_position;
 	std::vector<size_t> faceA;
 	std::vector<size_t> faceB;
@@ -136,17 +267,23 @@ static bool FindSparatingAxis(RigidBody* a, RigidBody* b, bool& flip, std::vecto
 
 	glm::vec3 sepAxisA;
 	glm::vec3 sepAxisB;
+	size_t faceIndexA = 0;
+	size_t faceIndexB = 0;
 
 	//For each face normal of collider A
 	for (size_t i = 0; i < colA->m_faces.size(); ++i)
 	{
 		float depth;
 		if (!SATFacePolygonGlobal(colA, colB, colA->m_faces[i], depth))
+		{
+			StoreAxis(cache, *colA, *colB, SeparatingAxisCache::FACE_A, i, 0, depth);
 			return false;
+		}
 
 		if (depth < minDepthA)
 		{
 			minDepthA = depth;
+			faceIndexA = i;
 			faceA = colA->m_faces[i].first;
 			sepAxisA = colA->m_faces[i].second;
 		}
@@ -157,16 +294,74 @@ static bool FindSparatingAxis(RigidBody* a, RigidBody* b, bool& flip, std::vecto
 	{
 		float depth;
 		if (!SATFacePolygonGlobal(colB, colA, colB->m_faces[i], depth))
+		{
+			StoreAxis(cache, *colA, *colB, SeparatingAxisCache::FACE_B, i, 0, depth);
 			return false;
+		}
 
 		if (depth < minDepthB)
 		{
 			minDepthB = depth;
+			faceIndexB = i;
 			faceB = colB->m_faces[i].first;
 			sepAxisB = colB->m_faces[i].second;
 		}
 	}
 
+	//Edge pairs whose Gauss map arcs cross, each edge once
+	float minDepthEdge = FLT_MAX;
+	size_t edgeA = 0;
+	size_t edgeB = 0;
+	glm::vec3 sepAxisEdge;
+
+	for (size_t i = 0; i < colA->m_edges.size(); ++i)
+	{
+		const auto& verticesA = colA->m_edges[i].first;
+		if (verticesA.first > verticesA.second)
+			continue;
+
+		for (size_t j = 0; j < colB->m_edges.size(); ++j)
+		{
+			const auto& verticesB = colB->m_edges[j].first;
+			if (verticesB.first > verticesB.second || !EdgeBuildMinkowski(colA, colB, i, j))
+				continue;
+
+			glm::vec3 startA = colA->m_vertices[verticesA.first];
+			glm::vec3 endA = colA->m_vertices[verticesA.second];
+			glm::vec3 startB = colB->m_vertices[verticesB.first];
+			glm::vec3 endB = colB->m_vertices[verticesB.second];
+
+			//parallel edges, their axis is a face axis already tested
+			glm::vec3 edgeCross = glm::cross(glm::normalize(endA - startA), glm::normalize(endB - startB));
+			if (glm::length2(edgeCross) < 1e-6f)
+				continue;
+
+			glm::vec3 axis;
+			float depth = DistanceEdgeEdge(colA, colB, startA, endA, startB, endB, axis);
+			if (depth <= 0.f)
+			{
+				StoreAxis(cache, *colA, *colB, SeparatingAxisCache::EDGES, i, j, depth);
+				return false;
+			}
+
+			if (depth < minDepthEdge)
+			{
+				minDepthEdge = depth;
+				edgeA = i;
+				edgeB = j;
+				sepAxisEdge = axis;
+			}
+		}
+	}
+
+	//Faces are preferred, edges only win when clearly shallower
+	if (minDepthEdge < 0.95f * std::min(minDepthA, minDepthB) - 0.0005f)
+	{
+		flip = false;
+		StoreAxis(cache, *colA, *colB, SeparatingAxisCache::EDGES, edgeA, edgeB, minDepthEdge);
+		return CreateEdgeContact(colA, colB, edgeA, edgeB, minDepthEdge, sepAxisEdge, cp);
+	}
+
 	float minDepth;
 	std::vector<size_t> face;
 	glm::vec3 sepAxis;
@@ -178,6 +373,7 @@ static bool FindSparatingAxis(RigidBody* a, RigidBody* b, bool& flip, std::vecto
 		minDepth = std::min(minDepthA,minDepthB);
 		face = faceA;
 		sepAxis = sepAxisA;
+		StoreAxis(cache, *colA, *colB, SeparatingAxisCache::FACE_A, faceIndexA, 0, minDepthA);
 	}
 	else
 	{
@@ -185,6 +381,7 @@ static bool FindSparatingAxis(RigidBody* a, RigidBody* b, bool& flip, std::vecto
 		minDepth = std::min(minDepthA, minDepthB);
 		face = faceB;
 		sepAxis = sepAxisB;
+		StoreAxis(cache, *colA, *colB, SeparatingAxisCache::FACE_B, faceIndexB, 0, minDepthB);
 	}
 
 	return CreateFaceContact(sepAxis, flip, face, colA, colB, cp);
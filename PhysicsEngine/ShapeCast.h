@@ -0,0 +1,321 @@
+#pragma once
+
+#include "RigidBody.h"
+
+#define SHAPE_CAST_MAX_ITER 64
+
+struct ShapeHit
+{
+	RigidBody* m_body = nullptr;
+	float m_t = 0.f;        // the shape touches m_body at from + m_t * (to - from)
+	glm::vec3 m_point;      // contact point on m_body
+	glm::vec3 m_normal;     // surface normal of m_body, facing the shape
+};
+
+//Point of the collider furthest along direction, with the collider centered at
+//position. Boxes and convex colliders are the unit box through rotation * scale,
+//the same matrix as their vertices, and a sphere's radius is m_scale.x
+static glm::vec3 ShapeSupport(const Collider& shape, const glm::vec3& position, const glm::vec3& direction)
+{
+	if (shape.m_type == BoundingType::SPHERE)
+	{
+		float length = glm::length(direction);
+		if (length < 1e-8f)
+			return position;
+		return position + direction * (shape.m_scale.x / length);
+	}
+
+	glm::mat3 basis = glm::mat3(glm::toMat4(shape.m_rotation));
+	glm::vec3 support = position;
+	for (int i = 0; i < 3; ++i)
+	{
+		glm::vec3 axis = basis[i] * shape.m_scale[i];
+		support += glm::dot(axis, direction) >= 0.f ? axis : -axis;
+	}
+	return support;
+}
+
+//Vertex of the Minkowski difference B - A, with the point of B it came from
+struct CastVertex
+{
+	glm::vec3 m_point;
+	glm::vec3 m_pointB;
+};
+
+struct CastSimplex
+{
+	CastVertex m_vertices[4];
+	float m_weights[4];
+	int m_count = 0;
+
+	void Set(const CastVertex& a, float wa)
+	{
+		m_vertices[0] = a;
+		m_weights[0] = wa;
+		m_count = 1;
+	}
+
+	void Set(const CastVertex& a, const CastVertex& b, float wa, float wb)
+	{
+		m_vertices[0] = a;
+		m_vertices[1] = b;
+		m_weights[0] = wa;
+		m_weights[1] = wb;
+		m_count = 2;
+	}
+
+	void Set(const CastVertex& a, const CastVertex& b, const CastVertex& c, float wa, float wb, float wc)
+	{
+		m_vertices[0] = a;
+		m_vertices[1] = b;
+		m_vertices[2] = c;
+		m_weights[0] = wa;
+		m_weights[1] = wb;
+		m_weights[2] = wc;
+		m_count = 3;
+	}
+};
+
+//Closest point to x of the triangle abc, out keeps the feature it lies on
+//(Ericson, Real-Time Collision Detection 5.1.5)
+static glm::vec3 ClosestOnTriangle(const CastVertex& A, const CastVertex& B, const CastVertex& C,
+								   const glm::vec3& x, CastSimplex& out)
+{
+	const glm::vec3& a = A.m_point;
+	const glm::vec3& b = B.m_point;
+	const glm::vec3& c = C.m_point;
+	glm::vec3 ab = b - a, ac = c - a;
+
+	glm::vec3 ax = x - a;
+	float d1 = glm::dot(ab, ax), d2 = glm::dot(ac, ax);
+	if (d1 <= 0.f && d2 <= 0.f)
+	{
+		out.Set(A, 1.f);
+		return a;
+	}
+
+	glm::vec3 bx = x - b;
+	float d3 = glm::dot(ab, bx), d4 = glm::dot(ac, bx);
+	if (d3 >= 0.f && d4 <= d3)
+	{
+		out.Set(B, 1.f);
+		return b;
+	}
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f)
+	{
+		float v = d1 / (d1 - d3);
+		out.Set(A, B, 1.f - v, v);
+		return a + v * ab;
+	}
+
+	glm::vec3 cx = x - c;
+	float d5 = glm::dot(ab, cx), d6 = glm::dot(ac, cx);
+	if (d6 >= 0.f && d5 <= d6)
+	{
+		out.Set(C, 1.f);
+		return c;
+	}
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f)
+	{
+		float w = d2 / (d2 - d6);
+		out.Set(A, C, 1.f - w, w);
+		return a + w * ac;
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f)
+	{
+		float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		out.Set(B, C, 1.f - w, w);
+		return b + w * (c - b);
+	}
+
+	float denom = 1.f / (va + vb + vc);
+	float v = vb * denom;
+	float w = vc * denom;
+	out.Set(A, B, C, 1.f - v - w, v, w);
+	return a + ab * v + ac * w;
+}
+
+//Closest point to x of the simplex. The simplex is reduced to the feature the
+//point lies on and its weights are set, x inside a tetrahedron returns x
+static glm::vec3 ClosestOnSimplex(CastSimplex& simplex, const glm::vec3& x)
+{
+	const CastVertex* v = simplex.m_vertices;
+
+	if (simplex.m_count == 1)
+	{
+		simplex.m_weights[0] = 1.f;
+		return v[0].m_point;
+	}
+
+	if (simplex.m_count == 2)
+	{
+		glm::vec3 ab = v[1].m_point - v[0].m_point;
+		float t = glm::dot(x - v[0].m_point, ab) / std::max(glm::dot(ab, ab), 1e-12f);
+		//Set overwrites the vertices v points to, keep the point first
+		if (t <= 0.f)
+		{
+			glm::vec3 closest = v[0].m_point;
+			simplex.Set(v[0], 1.f);
+			return closest;
+		}
+		if (t >= 1.f)
+		{
+			glm::vec3 closest = v[1].m_point;
+			simplex.Set(v[1], 1.f);
+			return closest;
+		}
+
+		simplex.m_weights[0] = 1.f - t;
+		simplex.m_weights[1] = t;
+		return v[0].m_point + t * ab;
+	}
+
+	if (simplex.m_count == 3)
+	{
+		CastSimplex reduced;
+		glm::vec3 closest = ClosestOnTriangle(v[0], v[1], v[2], x, reduced);
+		simplex = reduced;
+		return closest;
+	}
+
+	//Tetrahedron : the closest point is on a face x is in front of
+	static const int faces[4][4] = { { 0, 1, 2, 3 }, { 0, 2, 3, 1 }, { 0, 3, 1, 2 }, { 1, 3, 2, 0 } };
+
+	CastSimplex best;
+	glm::vec3 bestPoint = x;
+	float bestDistance = FLT_MAX;
+	bool outside = false;
+
+	for (const auto& f : faces)
+	{
+		const glm::vec3& a = v[f[0]].m_point;
+		glm::vec3 normal = glm::cross(v[f[1]].m_point - a, v[f[2]].m_point - a);
+		float sideX = glm::dot(normal, x - a);
+		float sideOpposite = glm::dot(normal, v[f[3]].m_point - a);
+		if (sideX * sideOpposite > 0.f)
+			continue;
+
+		outside = true;
+		CastSimplex face;
+		glm::vec3 closest = ClosestOnTriangle(v[f[0]], v[f[1]], v[f[2]], x, face);
+		float distance = glm::length2(x - closest);
+		if (distance < bestDistance)
+		{
+			bestDistance = distance;
+			bestPoint = closest;
+			best = face;
+		}
+	}
+
+	if (outside)
+	{
+		simplex = best;
+		return bestPoint;
+	}
+
+	//x is inside, weights from the signed volumes
+	glm::vec3 a = v[0].m_point;
+	float volume = glm::dot(v[1].m_point - a, glm::cross(v[2].m_point - a, v[3].m_point - a));
+	if (std::abs(volume) < 1e-12f)
+	{
+		for (int i = 0; i < 4; ++i)
+			simplex.m_weights[i] = 0.25f;
+		return x;
+	}
+
+	float w1 = glm::dot(x - a, glm::cross(v[2].m_point - a, v[3].m_point - a)) / volume;
+	float w2 = glm::dot(v[1].m_point - a, glm::cross(x - a, v[3].m_point - a)) / volume;
+	float w3 = glm::dot(v[1].m_point - a, glm::cross(v[2].m_point - a, x - a)) / volume;
+	simplex.m_weights[0] = 1.f - w1 - w2 - w3;
+	simplex.m_weights[1] = w1;
+	simplex.m_weights[2] = w2;
+	simplex.m_weights[3] = w3;
+	return x;
+}
+
+/// @brief Sweep shape from start by translation against body, with GJK ray
+/// casting (van den Bergen) : the ray t * translation is cast against the
+/// Minkowski difference body - shape, advancing to each separating plane
+/// @param maxT - Fraction of translation to search, hits further are ignored
+/// @return True if the shape touches body at hit.m_t <= maxT
+static bool ShapeCastBody(const Collider& shape, const glm::vec3& start, const glm::vec3& translation,
+						  RigidBody* body, float maxT, ShapeHit& hit)
+{
+	const Collider& other = *body->m_collider;
+	const float tolerance = 1e-4f;
+
+	CastSimplex simplex;
+	float t = 0.f;
+	glm::vec3 x(0.f);       // t * translation
+	glm::vec3 normal(0.f);
+	glm::vec3 v = x - (other.m_position - start);
+	float previousDistance = FLT_MAX;
+
+	int iterations = 0;
+	while (glm::dot(v, v) > tolerance * tolerance)
+	{
+		if (iterations++ == SHAPE_CAST_MAX_ITER)
+			return false;
+
+		CastVertex vertex;
+		vertex.m_pointB = ShapeSupport(other, other.m_position, v);
+		vertex.m_point = vertex.m_pointB - ShapeSupport(shape, start, -v);
+
+		glm::vec3 w = x - vertex.m_point;
+		float vw = glm::dot(v, w);
+		if (vw > 0.f)
+		{
+			//the plane through the support point separates, move x onto it
+			float vr = glm::dot(v, translation);
+			if (vr >= 0.f)
+				return false;
+
+			t -= vw / vr;
+			if (t > maxT)
+				return false;
+
+			x = t * translation;
+			normal = v;
+			previousDistance = FLT_MAX;
+		}
+		else
+		{
+			//no separating plane and v stopped shrinking : x touches the
+			//difference up to rounding (flat simplices, curved spheres)
+			float distance = glm::dot(v, v);
+			if (distance > previousDistance * (1.f - 1e-5f))
+				break;
+			previousDistance = distance;
+		}
+
+		if (simplex.m_count < 4)
+			simplex.m_vertices[simplex.m_count++] = vertex;
+
+		v = x - ClosestOnSimplex(simplex, x);
+
+		//x inside the tetrahedron, it touches the difference
+		if (simplex.m_count == 4)
+			break;
+	}
+
+	glm::vec3 pointB(0.f);
+	for (int i = 0; i < simplex.m_count; ++i)
+		pointB += simplex.m_weights[i] * simplex.m_vertices[i].m_pointB;
+
+	hit.m_body = body;
+	hit.m_t = t;
+	hit.m_point = pointB;
+
+	//overlapping from the start, no separating plane was found
+	if (t == 0.f || glm::dot(normal, normal) < 1e-12f)
+		hit.m_normal = glm::length2(translation) > 0.f ? -glm::normalize(translation) : glm::vec3(0.f);
+	else
+		hit.m_normal = glm::normalize(normal);
+	return true;
+}
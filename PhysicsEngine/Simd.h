@@ -0,0 +1,8 @@
+#pragma once
+
+// SSE is used where it is available (x64 always has it), with scalar
+// fallbacks otherwise
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PHYSICS_SSE
+#include <xmmintrin.h>
+#endif
@@ -0,0 +1,278 @@
+#include "TreeBroadphase.h"
+
+TreeBroadphase::TreeBroadphase(Shape* box)
+{
+	tree = new AABBDynamicTree(box);
+	staticTree = new AABBDynamicTree(box);
+
+	//one set of threads for both trees
+	staticTree->workerPool = tree->workerPool;
+}
+
+TreeBroadphase::~TreeBroadphase()
+{
+	delete tree;
+	delete staticTree;
+}
+
+void TreeBroadphase::AddProxy(RigidBody* body)
+{
+	body->m_proxyId = TreeOf(body)->Insert(body);
+	InvalidateSnapshot(body);
+}
+
+void TreeBroadphase::AddProxies(const std::vector<RigidBody*>& bodies)
+{
+	//one batch per tree
+	for (int dynamic = 0; dynamic < 2; ++dynamic)
+	{
+		batchBodies.clear();
+		for (RigidBody* body : bodies)
+		{
+			if (body->IsDynamic() == (dynamic == 1))
+				batchBodies.push_back(body);
+		}
+
+		if (batchBodies.empty())
+			continue;
+
+		AABBDynamicTree* target = dynamic ? tree : staticTree;
+		target->InsertBatch(batchBodies, batchIds);
+		for (size_t i = 0; i < batchBodies.size(); ++i)
+			batchBodies[i]->m_proxyId = batchIds[i];
+
+		InvalidateSnapshot(batchBodies[0]);
+	}
+}
+
+void TreeBroadphase::RemoveProxy(RigidBody* body)
+{
+	TreeOf(body)->Remove(body->m_proxyId);
+	body->m_proxyId = -1;
+	InvalidateSnapshot(body);
+}
+
+void TreeBroadphase::MoveProxy(RigidBody* body)
+{
+	TreeOf(body)->MoveProxy(body->m_proxyId);
+	InvalidateSnapshot(body);
+}
+
+void TreeBroadphase::RefilterProxy(RigidBody* body)
+{
+	TreeOf(body)->RefilterProxy(body->m_proxyId);
+}
+
+void TreeBroadphase::SetPairFilter(const std::function<bool(RigidBody*, RigidBody*)>& filter)
+{
+	Broadphase::SetPairFilter(filter);
+	tree->pairFilter = filter;
+}
+
+void TreeBroadphase::UpdateProxy(RigidBody* body, const glm::vec3& displacement)
+{
+	if (tree->UpdateProxy(body->m_proxyId, body->m_collider->m_aabb, displacement))
+		snapshotValid = false;
+}
+
+void TreeBroadphase::UpdatePairs()
+{
+	lastRotations = tree->Optimize(optimizeBudget);
+	tree->RebuildIfDegraded();
+	staticTree->RebuildIfDegraded();
+
+	pairs.clear();
+	staticPairs.clear();
+	tree->UpdatePairs(*staticTree,
+		[this](int proxyA, int proxyB) { pairs.emplace_back(proxyA, proxyB); },
+		[this](int proxyA, int proxyB) { staticPairs.emplace_back(proxyA, proxyB); });
+
+	if (!useSnapshot)
+		return;
+
+	//the static tree only changes when a static body is added, removed or moved
+	if (!staticSnapshotValid)
+	{
+		staticSnapshot.Build(*staticTree);
+		staticSnapshotValid = true;
+	}
+
+	snapshot.Build(*tree);
+	snapshotValid = true;
+}
+
+void TreeBroadphase::SetQuerySnapshot(bool enable)
+{
+	useSnapshot = enable;
+	snapshotValid = false;
+	staticSnapshotValid = false;
+
+	if (!enable)
+	{
+		snapshot.Clear();
+		staticSnapshot.Clear();
+	}
+}
+
+void TreeBroadphase::InvalidateSnapshot(RigidBody* body)
+{
+	if (body->IsDynamic())
+		snapshotValid = false;
+	else
+		staticSnapshotValid = false;
+}
+
+void TreeBroadphase::ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback)
+{
+	tree->ClearColliding();
+	staticTree->ClearColliding();
+
+	for (const auto& p : pairs)
+	{
+		if (!callback(tree->nodes[p.first].m_clientData, tree->nodes[p.second].m_clientData))
+			continue;
+
+		tree->SetColliding(p.first, true);
+		tree->SetColliding(p.second, true);
+	}
+
+	for (const auto& p : staticPairs)
+	{
+		if (!callback(tree->nodes[p.first].m_clientData, staticTree->nodes[p.second].m_clientData))
+			continue;
+
+		tree->SetColliding(p.first, true);
+		staticTree->SetColliding(p.second, true);
+	}
+}
+
+void TreeBroadphase::Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback)
+{
+	if (useSnapshot && snapshotValid && staticSnapshotValid)
+	{
+		bool stopped = false;
+		snapshot.Query(aabb, [&](RigidBody* body)
+			{
+				stopped = !callback(body);
+				return !stopped;
+			});
+
+		if (!stopped)
+			staticSnapshot.Query(aabb, callback);
+		return;
+	}
+
+	bool stopped = false;
+	tree->Query(aabb, [&](int proxyId)
+		{
+			stopped = !callback(tree->nodes[proxyId].m_clientData);
+			return !stopped;
+		});
+
+	if (stopped)
+		return;
+
+	staticTree->Query(aabb, [&](int proxyId)
+		{
+			return callback(staticTree->nodes[proxyId].m_clientData);
+		});
+}
+
+void TreeBroadphase::QuerySphere(const glm::vec3& center, float radius, const std::function<bool(RigidBody*)>& callback)
+{
+	bool stopped = false;
+	tree->QuerySphere(center, radius, [&](int proxyId)
+		{
+			stopped = !callback(tree->nodes[proxyId].m_clientData);
+			return !stopped;
+		});
+
+	if (stopped)
+		return;
+
+	staticTree->QuerySphere(center, radius, [&](int proxyId)
+		{
+			return callback(staticTree->nodes[proxyId].m_clientData);
+		});
+}
+
+void TreeBroadphase::QueryFrustum(const Frustum& frustum, const std::function<bool(RigidBody*)>& callback)
+{
+	bool stopped = false;
+	tree->QueryFrustum(frustum, [&](int proxyId)
+		{
+			stopped = !callback(tree->nodes[proxyId].m_clientData);
+			return !stopped;
+		});
+
+	if (stopped)
+		return;
+
+	staticTree->QueryFrustum(frustum, [&](int proxyId)
+		{
+			return callback(staticTree->nodes[proxyId].m_clientData);
+		});
+}
+
+void TreeBroadphase::RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+	const std::function<float(RigidBody*, float)>& callback)
+{
+	//the dynamic tree clips the ray before the static tree is searched
+	if (useSnapshot && snapshotValid && staticSnapshotValid)
+	{
+		snapshot.RayCast(origin, direction, maxT, [&](RigidBody* body, float t)
+			{
+				maxT = callback(body, t);
+				return maxT;
+			});
+
+		if (maxT > 0.f)
+			staticSnapshot.RayCast(origin, direction, maxT, callback);
+		return;
+	}
+
+	tree->RayCast(origin, direction, maxT, [&](int proxyId, float t)
+		{
+			maxT = callback(tree->nodes[proxyId].m_clientData, t);
+			return maxT;
+		});
+
+	if (maxT <= 0.f)
+		return;
+
+	staticTree->RayCast(origin, direction, maxT, [&](int proxyId, float t)
+		{
+			return callback(staticTree->nodes[proxyId].m_clientData, t);
+		});
+}
+
+void TreeBroadphase::RayCastPacket(RayPacket& packet, const std::function<float(int, RigidBody*, float)>& callback)
+{
+	//like RayCast, the dynamic tree clips the rays before the static tree
+	tree->RayCastPacket(packet, [&](int ray, int proxyId, float t)
+		{
+			return callback(ray, tree->nodes[proxyId].m_clientData, t);
+		});
+
+	if (packet.ActiveMask() == 0)
+		return;
+
+	staticTree->RayCastPacket(packet, [&](int ray, int proxyId, float t)
+		{
+			return callback(ray, staticTree->nodes[proxyId].m_clientData, t);
+		});
+}
+
+void TreeBroadphase::Rebuild()
+{
+	tree->Rebuild();
+	staticTree->Rebuild();
+	snapshotValid = false;
+	staticSnapshotValid = false;
+}
+
+void TreeBroadphase::Draw(int programId)
+{
+	tree->Draw(programId);
+	staticTree->Draw(programId);
+}
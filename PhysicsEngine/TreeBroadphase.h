@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Broadphase.h"
+#include "BVH.h"
+#include "QuantizedBVH.h"
+
+// Broadphase backed by two dynamic AABB trees, one for dynamic bodies and
+// one for static bodies so static-static pairs are never searched
+class TreeBroadphase : public Broadphase
+{
+public:
+	TreeBroadphase(Shape* box);
+	~TreeBroadphase();
+
+	void AddProxy(RigidBody* body) override;
+	void AddProxies(const std::vector<RigidBody*>& bodies) override;
+	void RemoveProxy(RigidBody* body) override;
+	void MoveProxy(RigidBody* body) override;
+	void RefilterProxy(RigidBody* body) override;
+	void UpdateProxy(RigidBody* body, const glm::vec3& displacement) override;
+
+	void UpdatePairs() override;
+	void ForEachPair(const std::function<bool(RigidBody*, RigidBody*)>& callback) override;
+
+	void Query(const AABB& aabb, const std::function<bool(RigidBody*)>& callback) override;
+	void QuerySphere(const glm::vec3& center, float radius, const std::function<bool(RigidBody*)>& callback) override;
+	void QueryFrustum(const Frustum& frustum, const std::function<bool(RigidBody*)>& callback) override;
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxT,
+		const std::function<float(RigidBody*, float)>& callback) override;
+
+	void RayCastPacket(RayPacket& packet, const std::function<float(int, RigidBody*, float)>& callback) override;
+
+	/// @brief Handed to the dynamic tree, which tests it while finding pairs
+	void SetPairFilter(const std::function<bool(RigidBody*, RigidBody*)>& filter) override;
+
+	void Rebuild() override;
+
+	/// @brief Answer queries and pair finding from 4-wide SIMD copies of the trees
+	void SetWide(bool enable) { tree->SetWide(enable); staticTree->SetWide(enable); }
+	bool IsWide() const { return tree->IsWide(); }
+
+	/// @brief Answer Query and RayCast from quantized snapshots of the trees,
+	/// rebuilt by UpdatePairs. Until the next UpdatePairs after a proxy is
+	/// added, removed or moved the trees are searched instead
+	void SetQuerySnapshot(bool enable);
+	bool IsQuerySnapshot() const { return useSnapshot; }
+	size_t GetSnapshotMemory() const { return snapshot.GetMemorySize() + staticSnapshot.GetMemorySize(); }
+
+	void Draw(int programId) override;
+	const char* GetName() const override { return "AABB Tree"; }
+
+	AABBDynamicTree* tree;
+	AABBDynamicTree* staticTree;
+
+	/// @brief Rebuild both trees with the parallel LBVH builder
+	void SetLinearBuild(bool enable) { tree->useLinearBuild = enable; staticTree->useLinearBuild = enable; }
+	bool IsLinearBuild() const { return tree->useLinearBuild; }
+
+	/// @brief Threads searching the pairs of moved proxies, 0 : one per hardware thread
+	void SetPairThreads(int count) { tree->pairThreadCount = count; }
+	int GetPairThreads() const { return tree->pairThreadCount; }
+
+	int optimizeBudget = 64; // dynamic tree nodes visited by Optimize each step
+	int lastRotations = 0;
+
+private:
+	AABBDynamicTree* TreeOf(RigidBody* body) { return body->IsDynamic() ? tree : staticTree; }
+	void InvalidateSnapshot(RigidBody* body);
+
+	std::vector<std::pair<int, int>> pairs;
+	std::vector<std::pair<int, int>> staticPairs;
+
+	std::vector<RigidBody*> batchBodies;
+	std::vector<int> batchIds;
+
+	QuantizedBVH snapshot;
+	QuantizedBVH staticSnapshot;
+	bool useSnapshot = false;
+	bool snapshotValid = false;
+	bool staticSnapshotValid = false;
+};
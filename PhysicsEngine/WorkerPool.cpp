@@ -0,0 +1,71 @@
+#include "WorkerPool.h"
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+void WorkerPool::Run(int count, const std::function<void(int)>& body)
+{
+	if (count <= 1)
+	{
+		if (count == 1)
+			body(0);
+		return;
+	}
+
+	while ((int)threads.size() < count - 1)
+	{
+		int index = (int)threads.size() + 1;
+		threads.emplace_back(&WorkerPool::WorkerLoop, this, index);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &body;
+		jobThreads = count;
+		running = count - 1;
+		++generation;
+	}
+	wake.notify_all();
+
+	body(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	finished.wait(lock, [this] { return running == 0; });
+	job = nullptr;
+}
+
+void WorkerPool::WorkerLoop(int thread)
+{
+	unsigned int seen = 0;
+	for (;;)
+	{
+		const std::function<void(int)>* body;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+
+			//a loop with fewer threads leaves this one parked
+			seen = generation;
+			if (thread >= jobThreads)
+				continue;
+			body = job;
+		}
+
+		(*body)(thread);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--running == 0)
+			finished.notify_one();
+	}
+}
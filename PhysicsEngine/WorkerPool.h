@@ -0,0 +1,40 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads kept between parallel loops, parked on a condition variable.
+// A loop pays a wake up instead of creating and joining its threads, which
+// matters when it runs every step or several times per build
+class WorkerPool
+{
+public:
+	WorkerPool() = default;
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	~WorkerPool();
+
+	/// @brief Run body(thread) for every thread in [0, count) and return once
+	/// all are done. Thread 0 is the caller, the others are created the first
+	/// time a loop needs them
+	void Run(int count, const std::function<void(int)>& body);
+
+	int GetThreadCount() const { return (int)threads.size() + 1; }
+
+private:
+	void WorkerLoop(int thread);
+
+	std::vector<std::thread> threads; // thread i + 1 of the loops
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	const std::function<void(int)>* job = nullptr;
+	int jobThreads = 0;   // threads of the current loop, caller included
+	int running = 0;      // pool threads still in the current loop
+	unsigned int generation = 0;
+	bool stopping = false;
+};
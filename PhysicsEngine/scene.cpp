@@ -34,6 +34,7 @@ using namespace gl;
 #include "framework.h"
 #include "texture.h"
 #include "Physics.h"
+#include "TreeBroadphase.h"
 #include "transform.h"
 
 #include <memory>
@@ -244,11 +245,7 @@ void Scene::InitializeScene()
 
     floor->rigidbody.SetDynamic(false);
 
-    g_Physics->AddPhysicsObject(floor);
-    g_Physics->AddPhysicsObject(sphere1);
-    g_Physics->AddPhysicsObject(box);
-    //g_Physics->AddPhysicsObject(box2);
-    g_Physics->AddPhysicsObject(sphere2);
+    g_Physics->AddPhysicsObjects({ floor, sphere1, box, sphere2 });
 
 
     g_Physics->Init();
@@ -294,6 +291,8 @@ void Scene::DrawMenu()
     if (ImGui::Button("Reset"))
     {
         objectRoot->Reset();
+        for (auto obj : g_Physics->GetStaticPhysicsObjects())
+            g_Physics->MovePhysicsObject(obj);
         objectRoot->removeStressObjects();
         debugDraw->contactPoints.clear();
         debugDraw->contactIndex.clear();
@@ -331,6 +330,24 @@ void Scene::DrawMenu()
         debugDraw->stressSphere = false;
     }
 
+    if (ImGui::Button("Spawn 1000"))
+    {
+        std::vector<Object*> spawned;
+        spawned.reserve(1000);
+        for (int i = 0; i < 1000; ++i)
+        {
+            glm::vec3 p = { rand() % 60 - 30.f, rand() % 60 - 30.f, rand() % 30 + 10.f };
+            Object* newobj;
+            if (debugDraw->stressSphere)
+                newobj = new Object("stressObject", spherePolygons, 0, spherePolygons, { 0.8,0.8,0.8 }, { 0.5,0.5,0.5 }, 120, BoundingType::SPHERE, true);
+            else
+                newobj = new Object("stressObject", boxPolygons, 0, boxPolygons, { 0.8,0.8,0.8 }, { 0.5,0.5,0.5 }, 120, BoundingType::CONVEX, true);
+            objectRoot->add(newobj, p);
+            spawned.push_back(newobj);
+        }
+        g_Physics->AddPhysicsObjects(spawned);
+    }
+
     //ImGui::Checkbox("Show Dockspace", &isDockspaceOpen);
 
     if (ImGui::CollapsingHeader("Graphics"))
@@ -355,6 +372,37 @@ void Scene::DrawMenu()
         ImGui::Checkbox("Draw Collider", &debugDraw->colliderDrawing);
         ImGui::Checkbox("Draw Velocity", &debugDraw->velocityDrawing);
         ImGui::Checkbox("Draw Tree", &debugDraw->treeDrawing);
+
+        const char* broadphaseNames[] = { "AABB Tree", "Sweep and Prune", "Hash Grid" };
+        int broadphaseType = static_cast<int>(g_Physics->GetBroadphaseType());
+        if (ImGui::Combo("Broadphase", &broadphaseType, broadphaseNames, IM_ARRAYSIZE(broadphaseNames)))
+            g_Physics->SetBroadphase(static_cast<BroadphaseType>(broadphaseType));
+        ImGui::Text("Broadphase Time : %.3f ms", g_Physics->m_broadphaseTime);
+
+        if (auto treeBroadphase = dynamic_cast<TreeBroadphase*>(g_Physics->broadphase))
+        {
+            ImGui::Text("Tree SAH Cost : %.2f", treeBroadphase->tree->ComputeSAHCost());
+            ImGui::SameLine();
+            ImGui::SliderInt("Rotation Budget", &treeBroadphase->optimizeBudget, 0, 1024);
+            ImGui::Text("Rotations : %d", treeBroadphase->lastRotations);
+
+            bool linear = treeBroadphase->IsLinearBuild();
+            if (ImGui::Checkbox("Linear Rebuild (LBVH)", &linear))
+                treeBroadphase->SetLinearBuild(linear);
+
+            if (ImGui::Button("Rebuild Tree"))
+                treeBroadphase->Rebuild();
+
+            bool wide = treeBroadphase->IsWide();
+            if (ImGui::Checkbox("Wide Tree (SIMD)", &wide))
+                treeBroadphase->SetWide(wide);
+
+            bool quantized = treeBroadphase->IsQuerySnapshot();
+            if (ImGui::Checkbox("Quantized Query Snapshot", &quantized))
+                treeBroadphase->SetQuerySnapshot(quantized);
+            if (quantized)
+                ImGui::Text("Snapshot Memory : %.1f KB", treeBroadphase->GetSnapshotMemory() / 1024.0f);
+        }
         ImGui::Checkbox("Draw Contact Points", &debugDraw->contactDraw);
         ImGui::SliderFloat("Bias Factor", &debugDraw->biasFactor, 0.0f, 1.0f);
         ImGui::SliderInt("Velocity Solver Iterations", &g_Physics->m_velocitySolveIt, 1, 200);
@@ -444,11 +492,7 @@ void Scene::DrawMenu()
                         objectRoot->instances[i].first->rigidbody.m_collider->m_objTr = Translate(curr_obj->rigidbody.m_collider->m_position.x, curr_obj->rigidbody.m_collider->m_position.y, curr_obj->rigidbody.m_collider->m_position.z)
                             * glm::toMat4(curr_obj->rigidbody.m_collider->m_rotation)
                             * Scale(curr_obj->rigidbody.m_collider->m_scale.x, curr_obj->rigidbody.m_collider->m_scale.y, curr_obj->rigidbody.m_collider->m_scale.z);
-                        g_Physics->tree->Remove(g_Physics->tree->FindIndex(&curr_obj->rigidbody));
-                        g_Physics->tree->Insert(&curr_obj->rigidbody);
-                        
-                        objectRoot->instances[i].first->rigidbody.m_collider->UpdateAABB();
-                        g_Physics->tree->Update();
+                        g_Physics->MovePhysicsObject(curr_obj);
                     }
 
                     if (ImGui::Button("Remove"))
@@ -609,7 +653,7 @@ void Scene::DrawScene()
     objectRoot->Draw(gBufferProgram);
 
     if (debugDraw->treeDrawing)
-        g_Physics->tree->Draw(gBufferProgram->programId);
+        g_Physics->broadphase->Draw(gBufferProgram->programId);
 
     if (debugDraw->contactDraw && debugDraw->contactPoints.size())
         DrawContactPoints(gBufferProgram);